@@ -24,6 +24,11 @@ extern void* start(int* itemCount, int batchSize,
                    int targetSize, int targetTypeSize,
                    int targetConversion,
                    int subsetPercent,
+                   int prefetchDepth,
+                   int readaheadMB,
+                   int readThreadCount,
+                   int ingestAhead,
+                   int cacheMB,
                    MediaParams* mediaParams,
                    DeviceParams* deviceParams,
                    MediaParams* ingestParams,
@@ -37,7 +42,9 @@ extern void* start(int* itemCount, int batchSize,
                                     datumSize, datumTypeSize,
                                     targetSize, targetTypeSize,
                                     targetConversion,
-                                    subsetPercent,
+                                    subsetPercent, prefetchDepth,
+                                    readaheadMB, readThreadCount, ingestAhead,
+                                    cacheMB,
                                     mediaParams, deviceParams, ingestParams,
                                     alphabet);
         int result = loader->start();
@@ -55,8 +62,7 @@ extern void* start(int* itemCount, int batchSize,
 
 extern int next(Loader* loader) {
     try {
-        loader->next();
-        return 0;
+        return loader->next();
     } catch(std::exception& ex) {
         printf("Exception at %s:%d %s\n", __FILE__, __LINE__, ex.what());
         return -1;
@@ -15,6 +15,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -25,13 +26,16 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <set>
 #include <memory>
-#include <deque>
+#include <algorithm>
 #include <random>
+#include <exception>
 
 #include "reader.hpp"
 #include "threadpool.hpp"
 #include "batchfile.hpp"
+#include "manifest.hpp"
 #include "media.hpp"
 
 using std::string;
@@ -45,22 +49,24 @@ using std::tuple;
 
 #define ARCHIVE_ITEM_COUNT  4096
 
-typedef std::pair<std::unique_ptr<ByteVect>,std::unique_ptr<ByteVect>> DataPair;
+// An item of an archive, claimed for a minibatch. Holding on to it keeps the
+// archive open.
+typedef std::pair<shared_ptr<BatchFile>, int> ItemRef;
 
 class Writer {
 public:
-    virtual int write() = 0;
+    virtual int write(int id) = 0;
 };
 
 class WriteThread : public ThreadPool {
 public:
-    WriteThread(Writer* writer)
-    : ThreadPool(1), _writer(writer) {
+    WriteThread(Writer* writer, int count)
+    : ThreadPool(count), _writer(writer) {
     }
 
 protected:
     virtual void work(int id) {
-        int result = _writer->write();
+        int result = _writer->write(id);
         if (result != 0) {
             stop();
         }
@@ -70,25 +76,136 @@ private:
     Writer*                     _writer;
 };
 
+// An item that was ingested before an earlier item of its archive was
+// written. The buffers are kept for later items.
+class ReorderSlot {
+public:
+    ReorderSlot() : _ready(false) {
+    }
+
+public:
+    ByteVect                    _data;
+    ByteVect                    _target;
+    bool                        _ready;
+};
+
+// An archive that is being written.
+class ArchiveBuild {
+public:
+    ArchiveBuild(const string& fileName, int itemCount)
+    : _itemCount(itemCount), _written(0), _aborted(false) {
+        _file.openForWrite(fileName, "");
+    }
+
+public:
+    BatchFile                   _file;
+    // Number of items that go into this archive.
+    int                         _itemCount;
+    // Number of items written so far.
+    int                         _written;
+    // Items that are ready but have to wait for an earlier item to be
+    // written first. The item at position pos waits in slot
+    // pos % _reorder.size(), so only that many items past the next one to
+    // be written can be held back.
+    vector<ReorderSlot>         _reorder;
+    // Set when an ingest thread failed, so that the items still held back
+    // will never be written.
+    bool                        _aborted;
+    mutex                       _mutex;
+    // Signaled when items have been written.
+    condition_variable          _space;
+};
+
+// Scratch space of one ingest thread.
+class IngestSlot {
+public:
+    IngestSlot(Media* media)
+    : _media(media), _dataBuf(0), _targetBuf(0),
+      _dataBufLen(0), _targetBufLen(0) {
+    }
+
+    ~IngestSlot() {
+        delete[] _targetBuf;
+        delete[] _dataBuf;
+        delete _media;
+    }
+
+public:
+    Media*                      _media;
+    char*                       _dataBuf;
+    char*                       _targetBuf;
+    int                         _dataBufLen;
+    int                         _targetBufLen;
+};
+
+// Builds the archives of a dataset from the files listed in its index.
+//
+// Archives are built on demand. The reader tells the writer which archive it
+// needs next and the writer builds that one first, followed by at most
+// ingestAhead more archives. Within that window every ingest thread claims
+// the next item of the most urgent archive that still has unclaimed items,
+// reads and ingests it and then appends it to its archive. Items that are
+// ready before an earlier item of the same archive are held back, so that
+// every archive lists its items in index order. Each finished archive is
+// recorded in memory and announced to the reader right away. If an item
+// cannot be ingested, the writer stops and waitFor() rethrows the error.
 class ArchiveWriter : public Writer {
 public:
     ArchiveWriter(int batchSize, const char* repoDir, const char* archiveDir,
                   const char* indexFile, const char* archivePrefix,
-                  bool shuffle,
+                  bool shuffle, int ingestAhead,
                   MediaParams* params, MediaParams* ingestParams,
                   int targetTypeSize, int targetConversion, char* alphabet)
     : _batchSize(batchSize),
       _repoDir(repoDir), _archiveDir(archiveDir),
       _indexFile(indexFile),
       _archivePrefix(archivePrefix),
-      _fileIdx(0), _itemCount(0), _started(false),
-      _dataBuf(0), _targetBuf(0), _dataBufLen(0), _targetBufLen(0) {
-        _media = Media::create(params, ingestParams, 0);
-        _writeThread = new WriteThread(this);
+      _ingestAhead(ingestAhead), _shuffle(shuffle),
+      _targetTypeSize(targetTypeSize), _targetConversion(targetConversion),
+      _itemCount(0), _fileCount(0), _finishedCount(0), _wanted(0),
+      _started(false), _stopping(false), _hasManifest(false), _reader(0) {
+        int threadCount = std::max(1, (int) thread::hardware_concurrency());
+        for (int i = 0; i < threadCount; i++) {
+            _slots.push_back(new IngestSlot(
+                    Media::create(params, ingestParams, i)));
+        }
+        _writeThread = new WriteThread(this, threadCount);
+        std::set<int> stale;
+        if (loadManifest() == true) {
+            stale = staleArchives();
+            if (stale.empty() == true) {
+                // Nothing to ingest. The index does not even need to be
+                // parsed.
+                _hasManifest = true;
+                _itemCount = _manifest._header._itemCount;
+                _fileCount = _manifest._archives.size();
+                _claimed.resize(_fileCount, 0);
+                _finished.resize(_fileCount, true);
+                _finishedCount = _fileCount;
+                return;
+            }
+            // Some archives are missing or damaged. They are rebuilt from
+            // the index and the manifest is replaced once they are done.
+        }
         _reader = new FileReader(&_itemCount, 1, repoDir, indexFile, shuffle,
                                  targetTypeSize, targetConversion,
                                  alphabet);
+        _fileCount = (_itemCount + _batchSize - 1) / _batchSize;
+        _claimed.resize(_fileCount, 0);
+        _finished.resize(_fileCount, false);
         if (Reader::exists(_archiveDir) == true) {
+            // Find out once which archives are already there.
+            for (int i = 0; i < _fileCount; i++) {
+                if ((stale.count(i) == 0) &&
+                    (Reader::exists(getFileName(i)) == true)) {
+                    _finished[i] = true;
+                    _finishedCount++;
+                }
+            }
+            if (_finishedCount == _fileCount) {
+                // Ingested before manifests were written.
+                writeManifest();
+            }
             return;
         }
         int result = mkdir(_archiveDir.c_str(), 0755);
@@ -101,86 +218,446 @@ public:
     }
 
     virtual ~ArchiveWriter() {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _work.notify_all();
         _writeThread->stop();
+        _writeThread->join();
         delete _writeThread;
+        // Archives that were not finished are not usable.
+        for (auto& item : _builds) {
+            item.second->_file.discard();
+            delete item.second;
+        }
         delete _reader;
-        delete[] _targetBuf;
-        delete[] _dataBuf;
-        delete _media;
+        for (auto slot : _slots) {
+            delete slot;
+        }
     }
 
-    void waitFor(string& name) {
-        if (_started == false) {
-            start();
-        }
+    int itemCount() {
+        return _itemCount;
+    }
+
+    // Return the manifest of the dataset if it was valid at startup.
+    Manifest* manifest() {
+        return (_hasManifest == true) ? &_manifest : 0;
+    }
+
+    bool finished(int fileIdx) {
+        lock_guard<mutex> lock(_mutex);
+        return (fileIdx < _fileCount) && (_finished[fileIdx] == true);
+    }
 
+    // Called by the reader before it opens an archive. Moves the build
+    // window up to that archive and waits until the archive is complete.
+    void waitFor(int fileIdx) {
         unique_lock<mutex> lock(_mutex);
-        while (_reader->exists(name) == false) {
+        if (fileIdx >= _fileCount) {
+            // Not one of ours. Let the reader deal with it.
+            return;
+        }
+        if (_wanted != fileIdx) {
+            _wanted = fileIdx;
+            _work.notify_all();
+        }
+        if ((_started == false) && (claimable() >= 0)) {
+            start();
+        }
+        while (_finished[fileIdx] == false) {
+            if (_error != nullptr) {
+                // The archive will never be finished.
+                std::rethrow_exception(_error);
+            }
             _write.wait(lock);
         }
     }
 
-    int write() {
-        if (_reader->eos() == true) {
+    int write(int id) {
+        try {
+            return writeItem(id);
+        } catch (...) {
+            // Stop ingesting and hand the error to the reader.
+            lock_guard<mutex> lock(_mutex);
+            if (_error == nullptr) {
+                _error = std::current_exception();
+            }
+            _stopping = true;
+            for (auto& item : _builds) {
+                lock_guard<mutex> buildLock(item.second->_mutex);
+                item.second->_aborted = true;
+                item.second->_space.notify_all();
+            }
+            _write.notify_all();
+            _work.notify_all();
             return 1;
         }
-        stringstream    fileName;
-        fileName << _archiveDir << '/' << _archivePrefix
-                 << _fileIdx++ << ".cpio";
-
-        if (Reader::exists(fileName.str()) == true) {
-            return 0;
-        }
-        BatchFile       batchFile(fileName.str(), "");
-        for (int i = 0; i < _batchSize; i++) {
-            int dataLen = 0;
-            int targetLen = 0;
-            int result = _reader->next(&_dataBuf, &_targetBuf,
-                                       &_dataBufLen, &_targetBufLen,
-                                       &dataLen, &targetLen);
-            if (result != 0) {
-                break;
+    }
+
+private:
+    int writeItem(int id) {
+        int itemIdx;
+        int fileIdx;
+        ArchiveBuild* build;
+        {
+            unique_lock<mutex> lock(_mutex);
+            while ((fileIdx = claimable()) < 0) {
+                if ((_stopping == true) || (_finishedCount == _fileCount)) {
+                    return 1;
+                }
+                // Nothing to do until the reader moves on.
+                _work.wait(lock);
+            }
+            if (_claimed[fileIdx] == 0) {
+                build = new ArchiveBuild(getFileName(fileIdx),
+                                         archiveSize(fileIdx));
+                if (_spareReorders.empty() == false) {
+                    build->_reorder.swap(_spareReorders.back());
+                    _spareReorders.pop_back();
+                } else {
+                    build->_reorder.resize(_slots.size());
+                }
+                _builds[fileIdx] = build;
+            } else {
+                build = _builds[fileIdx];
             }
-            // TODO: make this multithreaded.
-            _media->ingest(&_dataBuf, &_dataBufLen, &dataLen);
-            batchFile.writeItem(_dataBuf, _targetBuf,
-                                dataLen, targetLen);
+            itemIdx = fileIdx * _batchSize + _claimed[fileIdx]++;
         }
 
+        IngestSlot* slot = _slots[id];
+        int dataLen = 0;
+        int targetLen = 0;
+        _reader->readItem(itemIdx, &slot->_dataBuf, &slot->_targetBuf,
+                          &slot->_dataBufLen, &slot->_targetBufLen,
+                          &dataLen, &targetLen);
+        slot->_media->ingest(&slot->_dataBuf, &slot->_dataBufLen, &dataLen);
+
+        bool finished;
         {
-            unique_lock<mutex> lock(_mutex);
-            batchFile.close();
+            unique_lock<mutex> lock(build->_mutex);
+            int pos = itemIdx - fileIdx * _batchSize;
+            int window = build->_reorder.size();
+            if (pos != build->_written) {
+                // Hold the item back until the items before it have been
+                // written, waiting for a slot to be free if need be.
+                while (pos >= build->_written + window) {
+                    if (build->_aborted == true) {
+                        return 1;
+                    }
+                    build->_space.wait(lock);
+                }
+                if (pos != build->_written) {
+                    ReorderSlot& held = build->_reorder[pos % window];
+                    held._data.assign(slot->_dataBuf, slot->_dataBuf + dataLen);
+                    held._target.assign(slot->_targetBuf,
+                                        slot->_targetBuf + targetLen);
+                    held._ready = true;
+                    return 0;
+                }
+            }
+            build->_file.writeItem(slot->_dataBuf, slot->_targetBuf,
+                                   dataLen, targetLen);
+            build->_written++;
+            // Write out whatever was waiting on this item.
+            while (build->_reorder[build->_written % window]._ready == true) {
+                ReorderSlot& held = build->_reorder[build->_written % window];
+                build->_file.writeItem(held._data.data(), held._target.data(),
+                                       held._data.size(), held._target.size());
+                held._ready = false;
+                build->_written++;
+            }
+            finished = (build->_written == build->_itemCount);
+            build->_space.notify_all();
+        }
+
+        if (finished == true) {
+            // No other thread touches the build any more.
+            build->_file.close();
+            bool allFinished;
+            {
+                lock_guard<mutex> lock(_mutex);
+                _spareReorders.push_back(std::move(build->_reorder));
+                _builds.erase(fileIdx);
+                _finished[fileIdx] = true;
+                _finishedCount++;
+                allFinished = (_finishedCount == _fileCount);
+            }
+            delete build;
+            _write.notify_all();
+            _work.notify_all();
+            if (allFinished == true) {
+                writeManifest();
+            }
         }
-        _write.notify_one();
         return 0;
     }
 
-private:
     void start() {
         _writeThread->start();
         _started = true;
     }
 
+    // Return the most urgent archive within the build window that still
+    // has items to be claimed or -1 if there is none. Called with _mutex
+    // held.
+    int claimable() {
+        int count = std::min(_ingestAhead + 1, _fileCount);
+        for (int i = 0; i < count; i++) {
+            int fileIdx = (_wanted + i) % _fileCount;
+            if ((_finished[fileIdx] == false) &&
+                (_claimed[fileIdx] < archiveSize(fileIdx))) {
+                return fileIdx;
+            }
+        }
+        return -1;
+    }
+
+    int archiveSize(int fileIdx) {
+        return std::min(_batchSize, _itemCount - fileIdx * _batchSize);
+    }
+
+    string getManifestName() {
+        return _archiveDir + '/' + _archivePrefix + MANIFEST_NAME;
+    }
+
+    // Return true if there is a manifest that describes archives built
+    // from the current index with the current settings.
+    bool loadManifest() {
+        if (_manifest.read(getManifestName()) == false) {
+            return false;
+        }
+        ManifestHeader& header = _manifest._header;
+        uint fileCount = (header._itemCount + _batchSize - 1) / _batchSize;
+        if ((header._itemCount == 0) ||
+            (header._archiveItemCount != (uint) _batchSize) ||
+            (header._archiveCount != fileCount) ||
+            (header._targetTypeSize != _targetTypeSize) ||
+            (header._targetConversion != _targetConversion) ||
+            (header._shuffle != _shuffle) ||
+            (_manifest._signature != _slots[0]->_media->ingestSignature()) ||
+            (_manifest.matchesIndex(_indexFile) == false)) {
+            return false;
+        }
+        return true;
+    }
+
+    // Return the archives listed in the manifest that are missing or do not
+    // have the size that they had when the manifest was written.
+    std::set<int> staleArchives() {
+        std::set<int> result;
+        for (uint i = 0; i < _manifest._archives.size(); i++) {
+            struct stat stats;
+            if ((stat(getFileName(i).c_str(), &stats) != 0) ||
+                ((uint64_t) stats.st_size != _manifest._archives[i]._size)) {
+                result.insert(i);
+            }
+        }
+        return result;
+    }
+
+    void writeManifest() {
+        string signature = _slots[0]->_media->ingestSignature();
+        Manifest existing;
+        if ((existing.read(getManifestName()) == true) &&
+            (existing._signature != signature)) {
+            // Never replace a manifest of other ingest settings. The
+            // archives it describes may have been built with them.
+            return;
+        }
+        Manifest manifest;
+        ManifestHeader& header = manifest._header;
+        header._archiveItemCount = _batchSize;
+        header._targetTypeSize = _targetTypeSize;
+        header._targetConversion = _targetConversion;
+        header._shuffle = _shuffle;
+        manifest._signature = signature;
+        try {
+            for (int i = 0; i < _fileCount; i++) {
+                string fileName = getFileName(i);
+                BatchFile archive;
+                archive.openForRead(fileName);
+                struct stat stats;
+                if (stat(fileName.c_str(), &stats) != 0) {
+                    return;
+                }
+                ArchiveInfo info;
+                memset(&info, 0, sizeof(info));
+                info._itemCount = archive.itemCount();
+                info._maxDatumSize = archive.maxDatumSize();
+                info._maxTargetSize = archive.maxTargetSize();
+                info._size = stats.st_size;
+                manifest.addArchive(info);
+                header._itemCount += info._itemCount;
+            }
+            manifest.setIndex(_indexFile);
+        } catch (std::exception&) {
+            // The manifest is only a shortcut. Do without it.
+            return;
+        }
+        if ((int) header._itemCount != _itemCount) {
+            return;
+        }
+        manifest.write(getManifestName());
+    }
+
+    string getFileName(int fileIdx) {
+        stringstream ss;
+        ss << _archiveDir << '/' << _archivePrefix << fileIdx << ".cpio";
+        return ss.str();
+    }
+
 private:
     int                         _batchSize;
     string                      _repoDir;
     string                      _archiveDir;
     string                      _indexFile;
     string                      _archivePrefix;
-    // Index of current archive file.
-    int                         _fileIdx;
+    // Number of archives to build beyond the one that the reader needs.
+    int                         _ingestAhead;
+    int                         _shuffle;
+    int                         _targetTypeSize;
+    int                         _targetConversion;
     // Total number of items in this dataset.
     int                         _itemCount;
+    int                         _fileCount;
+    int                         _finishedCount;
+    // Index of the archive that the reader needs next.
+    int                         _wanted;
     bool                        _started;
+    bool                        _stopping;
+    bool                        _hasManifest;
+    Manifest                    _manifest;
+    // Number of items of each archive claimed by an ingest thread.
+    vector<int>                 _claimed;
+    vector<bool>                _finished;
+    // First error of an ingest thread, rethrown to the reader.
+    std::exception_ptr          _error;
     mutex                       _mutex;
+    // Signalled when an archive is finished.
     condition_variable          _write;
+    // Signalled when there may be new items to claim.
+    condition_variable          _work;
     WriteThread*                _writeThread;
     FileReader*                 _reader;
-    char*                       _dataBuf;
-    char*                       _targetBuf;
-    int                         _dataBufLen;
-    int                         _targetBufLen;
-    Media*                      _media;
+    vector<IngestSlot*>         _slots;
+    // Archives that are being written, keyed by their index.
+    map<int, ArchiveBuild*>     _builds;
+    // Reorder slots of finished archives, for the next ones to use.
+    vector<vector<ReorderSlot>> _spareReorders;
+};
+
+class ReadaheadThread : public ThreadPool {
+public:
+    ReadaheadThread()
+    : ThreadPool(1) {
+    }
+
+    virtual void stop() {
+        ThreadPool::stop();
+        {
+            lock_guard<mutex> lock(_mutex);
+        }
+        _pending.notify_one();
+    }
+
+    void request(const string& fileName, off_t offset, off_t length) {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _requests.push_back(Request(fileName, offset, length));
+        }
+        _pending.notify_one();
+    }
+
+protected:
+    virtual void work(int id) {
+        Request req;
+        {
+            unique_lock<mutex> lock(_mutex);
+            while ((_requests.empty() == true) && (_done == false)) {
+                _pending.wait(lock);
+            }
+            if (_done == true) {
+                return;
+            }
+            req = _requests.front();
+            _requests.pop_front();
+        }
+        int fd = open(req._fileName.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+        posix_fadvise(fd, req._offset, req._length, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+
+private:
+    class Request {
+    public:
+        Request() : _offset(0), _length(0) {
+        }
+
+        Request(const string& fileName, off_t offset, off_t length)
+        : _fileName(fileName), _offset(offset), _length(length) {
+        }
+
+        string                  _fileName;
+        off_t                   _offset;
+        off_t                   _length;
+    };
+
+    mutex                       _mutex;
+    condition_variable          _pending;
+    std::deque<Request>         _requests;
+};
+
+// Copies of archives kept in process memory, so that later epochs are served
+// without touching the file system. Archives are added as they are first
+// opened until the budget is used up. Nothing is ever evicted.
+class ArchiveCache {
+public:
+    explicit ArchiveCache(size_t budget) : _budget(budget), _used(0) {
+    }
+
+    // Return the cached copy of an archive, reading it in first if it fits
+    // within the budget. Returns null if the archive is not cached.
+    shared_ptr<MappedFile> get(int fileIdx, const string& fileName) {
+        auto it = _files.find(fileIdx);
+        if (it != _files.end()) {
+            return it->second;
+        }
+        if (_skipped.count(fileIdx) != 0) {
+            return nullptr;
+        }
+        struct stat stats;
+        if ((stat(fileName.c_str(), &stats) != 0) ||
+            (_used + stats.st_size > _budget)) {
+            _skipped.insert(fileIdx);
+            return nullptr;
+        }
+        shared_ptr<MappedFile> file = std::make_shared<MappedFile>(fileName,
+                                                                   true);
+        _used += file->size();
+        _files[fileIdx] = file;
+        return file;
+    }
+
+    // Return the size of a cached archive or -1 if it is not cached.
+    off_t size(int fileIdx) {
+        auto it = _files.find(fileIdx);
+        if (it == _files.end()) {
+            return -1;
+        }
+        return it->second->size();
+    }
+
+private:
+    size_t                      _budget;
+    size_t                      _used;
+    map<int, shared_ptr<MappedFile>> _files;
+    // Archives that did not fit.
+    std::set<int>               _skipped;
 };
 
 class ArchiveReader : public Reader {
@@ -192,6 +669,9 @@ public:
                   bool shuffle, bool reshuffle,
                   int startFileIdx,
                   int subsetPercent,
+                  int readaheadMB,
+                  int ingestAhead,
+                  int cacheMB,
                   MediaParams* params,
                   MediaParams* ingestParams,
                   int targetTypeSize,
@@ -201,93 +681,141 @@ public:
       _archiveDir(archiveDir), _indexFile(indexFile),
       _archivePrefix(archivePrefix),
       _startFileIdx(startFileIdx),
-      _fileIdx(startFileIdx), _itemIdx(0), _itemsLeft(0), _archiveWriter(0) {
+      _fileIdx(startFileIdx), _itemIdx(0), _itemsLeft(0), _global(false),
+      _orderIdx(0), _aheadIdx(0), _aheadBytes(0),
+      _readaheadBudget((off_t) readaheadMB << 20), _readahead(0),
+      _cache(0),
+      _manifest(0), _archiveWriter(0) {
         if (*itemCount == 0) {
-            *itemCount = getCount();
             // Create a writer just in case. It will only be used if archive
             // files are missing or damaged.
             _archiveWriter = new ArchiveWriter(ARCHIVE_ITEM_COUNT,
                     repoDir, archiveDir, indexFile, archivePrefix,
-                    shuffle, params, ingestParams,
+                    shuffle, ingestAhead, params, ingestParams,
                     targetTypeSize, targetConversion, alphabet);
+            *itemCount = getCount();
+            _manifest = _archiveWriter->manifest();
+        }
+        if (_manifest != 0) {
+            for (uint i = 0; i < _manifest->_archives.size(); i++) {
+                _archiveCounts[i] = _manifest->_archives[i]._itemCount;
+            }
         }
         _itemCount = *itemCount;
         assert(_itemCount != 0);
-        open();
+        std::random_device rd;
+        _rng.seed(rd());
+        if (_readaheadBudget > 0) {
+            _readahead = new ReadaheadThread();
+            _readahead->start();
+        }
+        if (cacheMB > 0) {
+            _cache = new ArchiveCache((size_t) cacheMB << 20);
+        }
+        reset();
     }
 
     virtual ~ArchiveReader() {
+        if (_readahead != 0) {
+            _readahead->stop();
+            delete _readahead;
+        }
         delete _archiveWriter;
         close();
+        delete _cache;
     }
 
     int read(BufferTuple& buffers) {
-        int offset = 0;
-        while (offset < _batchSize) {
-            int count = _batchSize - offset;
+        int result = claim(_claimed);
+        if (result != -1) {
+            fill(_claimed, buffers);
+        }
+        return result;
+    }
+
+    // Decide which items go into the next minibatch. Returns -1 on failure
+    // and 1 if the minibatch is the last one of an epoch. Minibatches are
+    // claimed one at a time, in the order that they are to be consumed.
+    int claim(vector<ItemRef>& items) {
+        // The last minibatch of an epoch is topped up from the start of the
+        // next one, and the next epoch carries on after those items. No item
+        // is handed out twice in an epoch, so epochs do not always start on
+        // a minibatch boundary. The next epoch is prefetched while the
+        // current one is still being consumed.
+        items.clear();
+        bool epochEnd = false;
+        while ((int) items.size() < _batchSize) {
+            int count = _batchSize - items.size();
             int result;
-            if (_reshuffle) {
-                result = readShuffle(buffers, count);
+            if (_global == true) {
+                result = claimShuffle(items, count);
             } else {
-                result = read(buffers, count);
+                result = claim(items, count);
             }
             if (result == -1) {
                 return -1;
             }
-            offset += result;
+            if (_itemIdx == _itemCount) {
+                reset();
+                epochEnd = true;
+            }
         }
 
-        assert(offset == _batchSize);
+        assert((int) items.size() == _batchSize);
         assert(_itemIdx <= _itemCount);
-        return 0;
+        return (epochEnd == false) ? 0 : 1;
+    }
+
+    // Put claimed items into buffers. The items are handed out as views, so
+    // this is cheap, and it may be called from several threads at once.
+    static void fill(const vector<ItemRef>& items, BufferTuple& buffers) {
+        for (auto& item : items) {
+            item.first->readItem(item.second, buffers);
+        }
     }
 
     int reset() {
         close();
         _fileIdx = _startFileIdx;
         _itemIdx = 0;
+        if (_reshuffle == true) {
+            // Shuffle across the whole dataset if all of it is available.
+            // While archives are still being written, they are visited in
+            // order and only the items within each one are shuffled.
+            _global = shuffle();
+            if (_global == true) {
+                readAheadShuffled();
+                return 0;
+            }
+        }
         open();
         return 0;
     }
 
+    // Sizes of the current archive. There is none while shuffling globally.
     int itemCount() {
-        return _batchFile.itemCount();
+        return (_batchFile != nullptr) ? _batchFile->itemCount() : 0;
     }
 
     int maxDatumSize() {
-        return _batchFile.maxDatumSize();
+        return (_batchFile != nullptr) ? _batchFile->maxDatumSize() : 0;
     }
 
     int maxTargetSize() {
-        return _batchFile.maxTargetSize();
+        return (_batchFile != nullptr) ? _batchFile->maxTargetSize() : 0;
     }
 
     int totalDataSize() {
-        return _batchFile.totalDataSize();
+        return (_batchFile != nullptr) ? _batchFile->totalDataSize() : 0;
     }
 
     int totalTargetsSize() {
-        return _batchFile.totalTargetsSize();
+        return (_batchFile != nullptr) ? _batchFile->totalTargetsSize() : 0;
     }
 
 private:
     int getCount() {
-        ifstream ifs(_indexFile);
-        if (!ifs) {
-            stringstream ss;
-            ss << "Could not open " << _indexFile;
-            throw std::ios_base::failure(ss.str());
-        }
-
-        string  line;
-        int     count = 0;
-        std::getline(ifs, line);
-        while (std::getline(ifs, line)) {
-            if (line[0] == '#') {
-                continue;
-            }
-            count++;
-        }
+        int count = _archiveWriter->itemCount();
 
         if (_subsetPercent != 100) {
             count  = (count * _subsetPercent) / 100;
@@ -301,60 +829,165 @@ private:
         return count;
     }
 
-    int read(BufferTuple& buffers, int count) {
+    int claim(vector<ItemRef>& items, int count) {
         if (_itemsLeft == 0) {
             next();
         }
         assert(_itemsLeft > 0);
         int realCount = std::min(count, _itemsLeft);
-        if (_itemIdx + realCount >= _itemCount) {
-            realCount = _itemCount - _itemIdx;
-            readExact(buffers, realCount);
-            reset();
-            return realCount;
-        }
-        readExact(buffers, realCount);
+        realCount = std::min(realCount, _itemCount - _itemIdx);
+        claimExact(items, realCount);
         return realCount;
     }
 
-    int replenishQueue(int count) {
-        // Make sure we have at least count in our queue
-        if ( (int) _shuffleQueue.size() >= count)
-            return 0;
+    bool shuffle() {
+        // Make a random permutation of every (archive, item) pair in the
+        // dataset. Returns false if some archive does not exist yet.
+        _order.clear();
+        _orderIdx = 0;
+        int fileIdx = _startFileIdx;
+        while ((int) _order.size() < _itemCount) {
+            shared_ptr<BatchFile> archive = getArchive(fileIdx);
+            if (archive == nullptr) {
+                return false;
+            }
+            int count = std::min(archive->itemCount(),
+                                 _itemCount - (int) _order.size());
+            for (int i = 0; i < count; i++) {
+                _order.push_back(std::make_pair(fileIdx, i));
+            }
+            fileIdx++;
+        }
+        std::shuffle(_order.begin(), _order.end(), _rng);
+        return true;
+    }
 
-        while (_itemsLeft > 0 && _itemIdx < _itemCount) {
-            DataPair d = _batchFile.readItem();
-            _shuffleQueue.push_back(std::move(d));
-            _itemIdx++;
-            _itemsLeft--;
+    shared_ptr<BatchFile> getArchive(int fileIdx) {
+        // Archives stay open while shuffling globally, so that any item can
+        // be handed out as a view without reopening its file.
+        int idx = fileIdx - _startFileIdx;
+        if (idx < (int) _archives.size()) {
+            return _archives[idx];
         }
-        std::random_device rd;
-        std::shuffle(_shuffleQueue.begin(), _shuffleQueue.end(),
-                     std::mt19937(rd()));
-        if (_itemIdx == _itemCount)
-            reset();
-        else
-            next();
-        return 0;
+        assert(idx == (int) _archives.size());
+        if ((_archiveWriter != 0) &&
+            (_archiveWriter->finished(fileIdx) == false)) {
+            return nullptr;
+        }
+        string fileName = getFileName(fileIdx);
+        shared_ptr<BatchFile> archive = std::make_shared<BatchFile>();
+        archive->openForRead(fileName, getCached(fileIdx, fileName));
+        _archives.push_back(archive);
+        return archive;
     }
 
-    int readShuffle(BufferTuple& buffers, int count) {
-        while ((int) _shuffleQueue.size() < count) {
-            replenishQueue(count);
+    int claimShuffle(vector<ItemRef>& items, int count) {
+        count = std::min(count, (int) _order.size() - _orderIdx);
+        auto first = _order.begin() + _orderIdx;
+        // Items that were read ahead no longer count against the budget.
+        for (int i = _orderIdx; i < std::min(_orderIdx + count, _aheadIdx); i++) {
+            _aheadBytes -= getArchive(_order[i].first)->itemSize(_order[i].second);
         }
-        for (int i=0; i<count; ++i) {
-            auto ee = std::move(_shuffleQueue.at(0));
-            get<0>(buffers)->read(&(*ee.first)[0], ee.first->size());
-            get<1>(buffers)->read(&(*ee.second)[0], ee.second->size());
-            _shuffleQueue.pop_front();
+        // The order of items within a minibatch does not matter, so visit
+        // them in file order to keep the reads close together.
+        std::sort(first, first + count);
+        for (auto it = first; it != first + count; ++it) {
+            items.push_back(ItemRef(_archives[it->first - _startFileIdx],
+                                    it->second));
         }
+        _orderIdx += count;
+        _itemIdx += count;
+        readAheadShuffled();
         return count;
     }
 
-    void readExact(BufferTuple& buffers, int count) {
+    void readAheadShuffled() {
+        // Every item is mapped already, so just ask for the pages of the
+        // items that are coming up next.
+        if (_orderIdx == 0) {
+            _aheadIdx = 0;
+            _aheadBytes = 0;
+        }
+        _aheadIdx = std::max(_aheadIdx, _orderIdx);
+        while ((_aheadBytes < _readaheadBudget) &&
+               (_aheadIdx < (int) _order.size())) {
+            auto& item = _order[_aheadIdx++];
+            _aheadBytes += getArchive(item.first)->willNeed(item.second);
+        }
+    }
+
+    void readAhead() {
+        // Ask for the archives that follow the current one, in the order
+        // that they will be visited, until the budget is used up. The last
+        // archive in the window may only be partly requested.
+        if (_readahead == 0) {
+            return;
+        }
+        off_t budget = _readaheadBudget;
+        int fileIdx = _fileIdx;
+        int items = _itemIdx + _itemsLeft;
+        while (budget > 0) {
+            if (items >= _itemCount) {
+                fileIdx = _startFileIdx;
+                items = 0;
+            } else {
+                fileIdx++;
+            }
+            if (fileIdx == _fileIdx) {
+                break;
+            }
+            string fileName = getFileName(fileIdx);
+            off_t size = getFileSize(fileIdx);
+            if (size < 0) {
+                // Not written yet.
+                break;
+            }
+            if ((_cache == 0) || (_cache->size(fileIdx) < 0)) {
+                // Cached archives need no help from the page cache.
+                off_t length = std::min(size, budget);
+                off_t& requested = _requested[fileIdx];
+                if (length > requested) {
+                    _readahead->request(fileName, requested,
+                                        length - requested);
+                    requested = length;
+                }
+                budget -= size;
+            }
+            auto count = _archiveCounts.find(fileIdx);
+            items += (count == _archiveCounts.end()) ?
+                     ARCHIVE_ITEM_COUNT : count->second;
+        }
+    }
+
+    shared_ptr<MappedFile> getCached(int fileIdx, const string& fileName) {
+        if (_cache == 0) {
+            return nullptr;
+        }
+        return _cache->get(fileIdx, fileName);
+    }
+
+    // Return the size of an archive or -1 if it does not exist.
+    off_t getFileSize(int fileIdx) {
+        if ((_cache != 0) && (_cache->size(fileIdx) >= 0)) {
+            return _cache->size(fileIdx);
+        }
+        if ((_manifest != 0) &&
+            (fileIdx < (int) _manifest->_archives.size())) {
+            return _manifest->_archives[fileIdx]._size;
+        }
+        struct stat stats;
+        if (stat(getFileName(fileIdx).c_str(), &stats) != 0) {
+            return -1;
+        }
+        return stats.st_size;
+    }
+
+    void claimExact(vector<ItemRef>& items, int count) {
         assert(count <= _itemsLeft);
-        for (int i = 0; i < count; ++i) {
-            _batchFile.readItem(buffers);
+        int first = _batchFile->itemCount() - _itemsLeft;
+        for (int i = first; i < first + count; ++i) {
+            int item = (_reshuffle == true) ? _itemOrder[i] : i;
+            items.push_back(ItemRef(_batchFile, item));
         }
         _itemsLeft -= count;
         _itemIdx += count;
@@ -366,19 +999,48 @@ private:
         open();
     }
 
-    void open() {
+    string getFileName(int fileIdx) {
         stringstream ss;
-        ss << _archiveDir << '/' << _archivePrefix << _fileIdx << ".cpio";
-        string fileName = ss.str();
-        if ((Reader::exists(fileName) == false) && (_archiveWriter != 0)) {
-            _archiveWriter->waitFor(fileName);
+        ss << _archiveDir << '/' << _archivePrefix << fileIdx << ".cpio";
+        return ss.str();
+    }
+
+    void open() {
+        string fileName = getFileName(_fileIdx);
+        if (_archiveWriter != 0) {
+            _archiveWriter->waitFor(_fileIdx);
+        }
+        // Minibatches that were claimed from the previous archive may still
+        // be reading from it, so it is not reused.
+        _batchFile = std::make_shared<BatchFile>();
+        _batchFile->openForRead(fileName, getCached(_fileIdx, fileName));
+        _itemsLeft = _batchFile->itemCount();
+        if ((_manifest != 0) &&
+            (_fileIdx < (int) _manifest->_archives.size()) &&
+            (_manifest->_archives[_fileIdx]._itemCount != (uint) _itemsLeft)) {
+            stringstream ss;
+            ss << fileName << " does not match "
+               << _archivePrefix << MANIFEST_NAME
+               << ". Remove the manifest to rebuild it.";
+            throw std::runtime_error(ss.str());
+        }
+        _archiveCounts[_fileIdx] = _itemsLeft;
+        // The pages of this archive may be evicted before the next epoch,
+        // so request it again next time around.
+        _requested.erase(_fileIdx);
+        readAhead();
+        if (_reshuffle == true) {
+            _itemOrder.resize(_itemsLeft);
+            for (int i = 0; i < _itemsLeft; i++) {
+                _itemOrder[i] = i;
+            }
+            std::shuffle(_itemOrder.begin(), _itemOrder.end(), _rng);
         }
-        _batchFile.openForRead(fileName);
-        _itemsLeft = _batchFile.itemCount();
     }
 
     void close() {
-        _batchFile.close();
+        // The archive is closed once the last item claimed from it is read.
+        _batchFile.reset();
     }
 
 private:
@@ -392,7 +1054,33 @@ private:
     int                         _itemIdx;
     // Number of items left in the current archive.
     int                         _itemsLeft;
-    BatchFile                   _batchFile;
-    std::deque<DataPair>        _shuffleQueue;
+    shared_ptr<BatchFile>       _batchFile;
+    // Whether the current epoch is shuffled across the whole dataset.
+    bool                        _global;
+    // Every (archive, item) pair of the dataset in the order of this epoch.
+    vector<std::pair<int, int>> _order;
+    int                         _orderIdx;
+    vector<shared_ptr<BatchFile>> _archives;
+    // Order of the items within the current archive when not shuffling
+    // globally.
+    vector<int>                 _itemOrder;
+    std::mt19937                _rng;
+    // Position in _order up to which items have been read ahead, and the
+    // size of the items that were read ahead but not read yet.
+    int                         _aheadIdx;
+    off_t                       _aheadBytes;
+    // Bytes that may be read ahead of the current position. Zero disables
+    // readahead.
+    off_t                       _readaheadBudget;
+    ReadaheadThread*            _readahead;
+    // Null unless archives are to be kept in memory.
+    ArchiveCache*               _cache;
+    // Bytes requested so far from each upcoming archive.
+    map<int, off_t>             _requested;
+    map<int, int>               _archiveCounts;
+    // Manifest of the dataset. Null if there was no valid one at startup.
+    Manifest*                   _manifest;
     ArchiveWriter*              _archiveWriter;
+    // Items of the minibatch being read by read().
+    vector<ItemRef>             _claimed;
 };
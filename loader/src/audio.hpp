@@ -134,12 +134,13 @@ private:
     }
 
     void loadIndex(string& indexFile) {
-        _index.load(indexFile, true);
+        _index = Index::get(indexFile);
+        _index->shuffle(_order);
     }
 
     void loadData(Codec* codec) {
-        for (uint i = 0; i < _index.size(); i++) {
-            string& fileName = _index[i]->_fileName;
+        for (int i : _order) {
+            string fileName = _index->fileName(i);
             int len = 0;
             readFile(fileName, &len);
             if (len == 0) {
@@ -185,7 +186,8 @@ private:
     string                      _indexFile;
     string                      _indexDir;
     vector<RawMedia*>           _data;
-    Index                       _index;
+    shared_ptr<Index>           _index;
+    vector<int>                 _order;
     char*                       _buf;
     int                         _bufLen;
 };
@@ -25,18 +25,19 @@
 #include "streams.hpp"
 
 #define FORMAT_VERSION  1
-#define WRITER_VERSION  1
+#define WRITER_VERSION  2
 #define MAGIC_STRING    "MACR"
 #define CPIO_FOOTER     "TRAILER!!!"
+#define CPIO_INDEX      "cpioidx"
 
 using std::string;
 using std::stringstream;
 using std::unique_ptr;
+using std::shared_ptr;
 using std::ignore;
 
 typedef std::vector<string> LineList;
 typedef std::vector<char> ByteVect;
-typedef std::pair<unique_ptr<ByteVect>,unique_ptr<ByteVect>> DataPair;
 
 static_assert(sizeof(int) == 4, "Unsupported platform");
 static_assert(sizeof(short) == 2, "Unsupported platform");
@@ -55,10 +56,16 @@ Individual items are packed into a macrobatch file as follows:
     - datum 2
     - target 2
       ...
+    - index
     - trailer
 
 Each of these items comprises of a cpio header record followed by data.
 
+The index holds an ItemOffset for every item so that items can be looked up
+without walking the archive. Its location is recorded in the header. Files
+written before the index was introduced have zero there and are indexed when
+they are opened by walking the record headers once.
+
 */
 
 class RecordHeader {
@@ -79,25 +86,16 @@ public:
         dst[1] = (ushort) src;
     }
 
-    void read(IfStream& ifs, uint* fileSize) {
-        ifs.read(&_magic);
-        assert(_magic == 070707);
-        ifs.read(&_dev);
-        ifs.read(&_ino);
-        ifs.read(&_mode);
-        ifs.read(&_uid);
-        ifs.read(&_gid);
-        ifs.read(&_nlink);
-        ifs.read(&_rdev);
-        uint mtime;
-        ifs.read(&_mtime);
-        loadDoubleShort(&mtime, _mtime);
-        ifs.read(&_namesize);
-        ifs.read(&_filesize);
+    // Parse a header in place. Returns the length of the file name that
+    // follows it, including padding.
+    uint read(const char* src, uint* fileSize) {
+        static_assert(sizeof(RecordHeader) == 26, "record header is not 26 bytes");
+        memcpy((void*) this, src, sizeof(RecordHeader));
+        if (_magic != 070707) {
+            throw std::runtime_error("Corrupt archive\n");
+        }
         loadDoubleShort(fileSize, _filesize);
-        // Skip over filename.
-        ifs.seekg(_namesize, ifs.cur);
-        ifs.readPadding(_namesize);
+        return _namesize + (_namesize % 2);
     }
 
     void write(OfStream& ofs, uint fileSize, const char* fileName) {
@@ -136,31 +134,31 @@ public:
     ushort                      _filesize[2];
 };
 
+// Location of an item's payloads, in bytes from the start of the file.
+class ItemOffset {
+public:
+    uint                        _datumOffset;
+    uint                        _datumSize;
+    uint                        _targetOffset;
+    uint                        _targetSize;
+};
+
 class BatchFileHeader {
 friend class BatchFile;
 public:
     BatchFileHeader()
     : _formatVersion(FORMAT_VERSION), _writerVersion(WRITER_VERSION),
       _itemCount(0), _maxDatumSize(0), _maxTargetSize(0),
-      _totalDataSize(0), _totalTargetsSize(0) {
+      _totalDataSize(0), _totalTargetsSize(0), _indexOffset(0) {
         memset(_dataType, 0, sizeof(_dataType));
         memset(_unused, 0, sizeof(_unused));
     }
 
-    void read(IfStream& ifs) {
-        ifs.read(&_magic);
+    void read(const char* src) {
+        memcpy((void*) this, src, sizeof(BatchFileHeader));
         if (strncmp(_magic, MAGIC_STRING, 4) != 0) {
             throw std::runtime_error("Unrecognized format\n");
         }
-        ifs.read(&_formatVersion);
-        ifs.read(&_writerVersion);
-        ifs.read(&_dataType);
-        ifs.read(&_itemCount);
-        ifs.read(&_maxDatumSize);
-        ifs.read(&_maxTargetSize);
-        ifs.read(&_totalDataSize);
-        ifs.read(&_totalTargetsSize);
-        ifs.read(&_unused);
     }
 
     void write(OfStream& ofs) {
@@ -173,6 +171,7 @@ public:
         ofs.write(&_maxTargetSize);
         ofs.write(&_totalDataSize);
         ofs.write(&_totalTargetsSize);
+        ofs.write(&_indexOffset);
         ofs.write(&_unused);
     }
 
@@ -187,7 +186,9 @@ private:
     uint                        _maxTargetSize;
     uint                        _totalDataSize;
     uint                        _totalTargetsSize;
-    char                        _unused[24];
+    // Offset of the index record header. Zero if there is none.
+    uint                        _indexOffset;
+    char                        _unused[20];
 #pragma pack()
 };
 
@@ -201,18 +202,13 @@ public:
         ofs.write(&_unused);
     }
 
-    void read(IfStream& ifs) {
-        ifs.read(&_unused);
-    }
-
 private:
     uint                        _unused[4];
 };
 
 class BatchFile {
 public:
-    BatchFile() : _fileHeaderOffset(0)  {
-        _ifs.exceptions(_ifs.failbit);
+    BatchFile() : _fileHeaderOffset(0), _pos(0), _nextItem(0)  {
         _ofs.exceptions(_ofs.failbit);
     }
 
@@ -228,13 +224,34 @@ public:
         close();
     }
 
-    void openForRead(const string& fileName) {
-        assert(_ifs.is_open() == false);
-        _ifs.open(fileName, IfStream::binary);
-        uint fileSize;
-        _recordHeader.read(_ifs, &fileSize);
-        assert(fileSize == sizeof(_fileHeader));
-        _fileHeader.read(_ifs);
+    // Pass in map to read from a copy of the archive that is already in
+    // memory.
+    void openForRead(const string& fileName,
+                     const shared_ptr<MappedFile>& map = nullptr) {
+        // Archives are mapped rather than streamed. Items are handed out as
+        // views into the mapping, which stays alive for as long as any
+        // buffer refers to it.
+        assert(_map == nullptr);
+        _fileName = fileName;
+        if (map != nullptr) {
+            _map = map;
+        } else {
+            _map = std::make_shared<MappedFile>(fileName);
+        }
+        _pos = 0;
+        uint fileSize = readRecordHeader();
+        if (fileSize != sizeof(_fileHeader)) {
+            throw std::runtime_error("Unrecognized format\n");
+        }
+        _fileHeader.read(take(fileSize));
+        _nextItem = 0;
+        _offsets.clear();
+        // Without a usable index, items are found by walking the file. The
+        // index is complete before any item is read, so that items can be
+        // read from several threads at once.
+        if ((_fileHeader._indexOffset == 0) || (loadIndex() == false)) {
+            buildIndex();
+        }
     }
 
     void openForWrite(const string& fileName, const string& dataType) {
@@ -243,6 +260,7 @@ public:
         _tempName = fileName + ".tmp";
         assert(_ofs.is_open() == false);
         _ofs.open(_tempName, OfStream::binary);
+        _offsets.clear();
         _recordHeader.write(_ofs, 64, "cpiohdr");
         _fileHeaderOffset = _ofs.tellp();
         memset(_fileHeader._dataType, ' ', sizeof(_fileHeader._dataType));
@@ -253,10 +271,16 @@ public:
     }
 
     void close() {
-        if (_ifs.is_open() == true) {
-            _ifs.close();
-        }
+        _map.reset();
         if (_ofs.is_open() == true) {
+            // Write the index.
+            uint indexSize = _offsets.size() * sizeof(ItemOffset);
+            if (indexSize != 0) {
+                _fileHeader._indexOffset = _ofs.tellp();
+                _recordHeader.write(_ofs, indexSize, CPIO_INDEX);
+                _ofs.write((char*) &_offsets[0], indexSize);
+                _ofs.writePadding(indexSize);
+            }
             // Write the trailer.
             static_assert(sizeof(_fileTrailer) == 16,
                           "file trailer is not 16 bytes");
@@ -276,50 +300,70 @@ public:
         }
     }
 
-    void readItem(BufferTuple& buffers) {
-        uint datumSize;
-        uint targetSize;
-        _recordHeader.read(_ifs, &datumSize);
+    // Give up on an archive that is being written. Nothing is left behind.
+    void discard() {
+        if (_ofs.is_open() == true) {
+            _ofs.close();
+            unlink(_tempName.c_str());
+        }
+    }
 
-        CharBuffer* data;
-        CharBuffer* targets;
-        tie(data, targets, ignore) = buffers;
-        data->read(_ifs, datumSize);
+    // Read the next item.
+    void readItem(BufferTuple& buffers) {
+        readItem(_nextItem++, buffers);
+    }
 
-        _ifs.readPadding(datumSize);
-        _recordHeader.read(_ifs, &targetSize);
-        targets->read(_ifs, targetSize);
-        _ifs.readPadding(targetSize);
+    // Read the item at the given position in the file. Safe to call from
+    // several threads at once.
+    void readItem(int index, BufferTuple& buffers) {
+        const ItemOffset& offset = getOffset(index);
+        get<0>(buffers)->view(_map->data() + offset._datumOffset,
+                              offset._datumSize, _map);
+        get<1>(buffers)->view(_map->data() + offset._targetOffset,
+                              offset._targetSize, _map);
     }
 
-    DataPair readItem() {
-        uint datumSize = 0;
-        _recordHeader.read(_ifs, &datumSize);
-        unique_ptr<ByteVect> datum(new ByteVect((size_t) datumSize));
-        _ifs.read(&(*datum)[0], datumSize);
-        _ifs.readPadding(datumSize);
+    // Combined size of the datum and target of an item.
+    uint itemSize(int index) {
+        const ItemOffset& offset = getOffset(index);
+        return offset._datumSize + offset._targetSize;
+    }
 
-        uint targetSize = 0;
-        _recordHeader.read(_ifs, &targetSize);
-        unique_ptr<ByteVect> target(new ByteVect((size_t) targetSize));
-        _ifs.read(&(*target)[0], targetSize);
-        _ifs.readPadding(targetSize);
-        return DataPair(std::move(datum), std::move(target));
+    // Ask the kernel to start paging in an item. Returns its size.
+    uint willNeed(int index) {
+        const ItemOffset& offset = getOffset(index);
+        if (_map->loaded() == true) {
+            // Already in memory.
+            return offset._datumSize + offset._targetSize;
+        }
+        static const uintptr_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+        uintptr_t start = (uintptr_t) (_map->data() + offset._datumOffset);
+        uintptr_t end = (uintptr_t) (_map->data() + offset._targetOffset +
+                                     offset._targetSize);
+        start &= ~pageMask;
+        madvise((void*) start, end - start, MADV_WILLNEED);
+        return offset._datumSize + offset._targetSize;
     }
 
     void writeItem(char* datum, char* target,
                    uint datumSize, uint targetSize) {
         char fileName[16];
+        ItemOffset offset;
         // Write the datum.
         sprintf(fileName, "cpiodtm%d",  _fileHeader._itemCount);
         _recordHeader.write(_ofs, datumSize, fileName);
+        offset._datumOffset = _ofs.tellp();
+        offset._datumSize = datumSize;
         _ofs.write(datum, datumSize);
         _ofs.writePadding(datumSize);
         // Write the target.
         sprintf(fileName, "cpiotgt%d",  _fileHeader._itemCount);
         _recordHeader.write(_ofs, targetSize, fileName);
+        offset._targetOffset = _ofs.tellp();
+        offset._targetSize = targetSize;
         _ofs.write(target, targetSize);
         _ofs.writePadding(targetSize);
+        _offsets.push_back(offset);
 
         _fileHeader._maxDatumSize =
                 std::max(datumSize, _fileHeader._maxDatumSize);
@@ -357,7 +401,94 @@ public:
     }
 
 private:
-    IfStream                    _ifs;
+    char* take(uint len) {
+        // Claim the next len bytes of the mapped archive.
+        if ((_pos > _map->size()) || (len > _map->size() - _pos)) {
+            stringstream ss;
+            ss << "Truncated archive " << _fileName;
+            throw std::runtime_error(ss.str());
+        }
+        char* result = _map->data() + _pos;
+        _pos += len;
+        return result;
+    }
+
+    uint readRecordHeader() {
+        uint fileSize;
+        uint nameLen = _recordHeader.read(take(sizeof(RecordHeader)), &fileSize);
+        // Skip over filename.
+        take(nameLen);
+        return fileSize;
+    }
+
+    char* readRecord(uint size) {
+        char* result = take(size);
+        // Skip the padding byte if size is odd.
+        take(size % 2);
+        return result;
+    }
+
+    // Returns false if the index does not fit in the file or points outside
+    // it. The file is then indexed by walking it, as an older one would be.
+    bool loadIndex() {
+        size_t pos = _pos;
+        size_t indexSize = _fileHeader._itemCount * sizeof(ItemOffset);
+        _pos = _fileHeader._indexOffset;
+        try {
+            if ((indexSize == 0) || (readRecordHeader() != indexSize) ||
+                (indexSize > _map->size() - _pos)) {
+                _pos = pos;
+                return false;
+            }
+        } catch (std::runtime_error&) {
+            _pos = pos;
+            return false;
+        }
+        _offsets.resize(_fileHeader._itemCount);
+        memcpy(&_offsets[0], _map->data() + _pos, indexSize);
+        _pos = pos;
+        for (auto& offset : _offsets) {
+            if ((offset._datumOffset + (size_t) offset._datumSize > _map->size()) ||
+                (offset._targetOffset + (size_t) offset._targetSize > _map->size())) {
+                _offsets.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void buildIndex() {
+        // Older files have no index. Walk the record headers once to make one.
+        size_t pos = _pos;
+        _pos = 0;
+        take(readRecordHeader());
+        // Every item takes at least two record headers.
+        if (_fileHeader._itemCount > _map->size() / (2 * sizeof(RecordHeader))) {
+            stringstream ss;
+            ss << "Corrupt archive " << _fileName;
+            throw std::runtime_error(ss.str());
+        }
+        std::vector<ItemOffset> offsets(_fileHeader._itemCount);
+        for (auto& offset : offsets) {
+            offset._datumSize = readRecordHeader();
+            offset._datumOffset = _pos;
+            readRecord(offset._datumSize);
+            offset._targetSize = readRecordHeader();
+            offset._targetOffset = _pos;
+            readRecord(offset._targetSize);
+        }
+        _offsets.swap(offsets);
+        _pos = pos;
+    }
+
+    const ItemOffset& getOffset(int index) {
+        if ((index < 0) || (index >= (int) _offsets.size())) {
+            throw std::out_of_range("Item index out of range");
+        }
+        return _offsets[index];
+    }
+
+private:
     OfStream                    _ofs;
     BatchFileHeader             _fileHeader;
     BatchFileTrailer            _fileTrailer;
@@ -365,6 +496,12 @@ private:
     int                         _fileHeaderOffset;
     string                      _fileName;
     string                      _tempName;
+    // Mapping of the archive being read and the read position within it.
+    shared_ptr<MappedFile>      _map;
+    size_t                      _pos;
+    // Index of the next item for sequential reads.
+    int                         _nextItem;
+    std::vector<ItemOffset>     _offsets;
 };
 
 // Some utilities that would be used by batch writers
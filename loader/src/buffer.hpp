@@ -19,6 +19,7 @@
 #endif
 
 #include <vector>
+#include <memory>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -34,7 +35,9 @@ using std::tie;
 using std::make_pair;
 using std::mutex;
 using std::unique_lock;
+using std::lock_guard;
 using std::condition_variable;
+using std::shared_ptr;
 
 template<typename T>
 class Buffer {
@@ -67,6 +70,8 @@ public:
         _idx = 0;
         _items.clear();
         _lens.clear();
+        _views.clear();
+        _owners.clear();
     }
 
     void dump() {
@@ -96,6 +101,7 @@ public:
     void pushItem(int len) {
         _items.push_back(_idx);
         _lens.push_back(len);
+        _views.push_back(0);
         _cur += len;
         _idx += len;
     }
@@ -105,6 +111,9 @@ public:
             return 0;
         }
         len = _lens[index];
+        if (_views[index] != 0) {
+            return _views[index];
+        }
         return _data + _items[index];
     }
 
@@ -124,18 +133,23 @@ public:
         return _idx;
     }
 
-    void read(IfStream& ifs, int size) {
-        resizeIfNeeded(size);
-        ifs.read(_cur, size);
-        pushItem(size);
-    }
-
     void read(T* src, int size) {
         resizeIfNeeded(size);
         memcpy((void *) _cur, (void *) src, size * sizeof(T));
         pushItem(size);
     }
 
+    // Add an item that refers to memory owned by someone else instead of
+    // copying it. The owner is kept alive until the buffer is reset.
+    void view(T* src, int size, const shared_ptr<void>& owner) {
+        _items.push_back(_idx);
+        _lens.push_back(size);
+        _views.push_back(src);
+        if ((_owners.empty() == true) || (_owners.back() != owner)) {
+            _owners.push_back(owner);
+        }
+    }
+
 private:
     void resizeIfNeeded(int inc) {
         if (getLevel() + inc > getSize()) {
@@ -196,6 +210,9 @@ protected:
     int                         _idx;
     vector<int>                 _items;
     vector<int>                 _lens;
+    // Items added with view(). Null for items stored in _data.
+    vector<T*>                  _views;
+    vector<shared_ptr<void>>    _owners;
     bool                        _alloc;
     bool                        _pinned;
 };
@@ -204,15 +221,25 @@ typedef Buffer<char>                                    CharBuffer;
 typedef Buffer<int>                                     IntBuffer;
 typedef tuple<CharBuffer*, CharBuffer*, IntBuffer*>     BufferTuple;
 
+// A fixed ring of buffer tuples shared by a producer and a consumer.
+//
+// The producer reserves the next free slot, fills it and then publishes it.
+// The consumer acquires the oldest published slot, uses it and then releases
+// it. The pool mutex only guards the slot counters, so neither side is ever
+// blocked by the other side filling or draining a slot. Several slots may be
+// reserved at a time, by one or more producers. The consumer always sees them
+// in the order that they were reserved.
 class BufferPool {
 public:
     BufferPool(int dataSize, int targetSize, int metaSize, bool pinned = false, int count = 2)
-    : _count(count), _used(0), _readPos(0), _writePos(0) {
+    : _count(count), _used(0), _reserved(0),
+      _readPos(0), _reservePos(0), _aborted(false) {
         for (int i = 0; i < count; i++) {
             CharBuffer* dataBuffer = new CharBuffer(dataSize, pinned);
             CharBuffer* targetBuffer = new CharBuffer(targetSize, pinned);
             IntBuffer* metaBuffer = new IntBuffer(metaSize, pinned);
             _bufs.push_back(make_tuple(dataBuffer, targetBuffer, metaBuffer));
+            _filled.push_back(false);
         }
     }
 
@@ -224,56 +251,115 @@ public:
         }
     }
 
-    BufferTuple& getForWrite() {
-        BufferTuple& result = _bufs[_writePos];
-        std::get<0>(result)->reset();
-        std::get<1>(result)->reset();
-        std::get<2>(result)->reset();
+    // Wait for a free slot and hand it to the producer. Returns 0 if the
+    // pool was aborted while waiting.
+    BufferTuple* reserve() {
+        BufferTuple* result;
+        {
+            unique_lock<mutex> lock(_mutex);
+            while ((_used + _reserved == _count) && (_aborted == false)) {
+                _nonFull.wait(lock);
+            }
+            if (_aborted == true) {
+                return 0;
+            }
+            result = &_bufs[_reservePos];
+            _reserved++;
+            advance(_reservePos);
+        }
+        std::get<0>(*result)->reset();
+        std::get<1>(*result)->reset();
+        std::get<2>(*result)->reset();
         return result;
     }
 
-    BufferTuple& getForRead() {
-        return _bufs[_readPos];
-    }
-
-    void advanceReadPos() {
-        _used--;
-        advance(_readPos);
-    }
-
-    void advanceWritePos() {
-        _used++;
-        advance(_writePos);
+    // Make the oldest reserved slot visible to the consumer.
+    void publish() {
+        {
+            lock_guard<mutex> lock(_mutex);
+            assert(_reserved > 0);
+            _reserved--;
+            _used++;
+        }
+        _nonEmpty.notify_all();
     }
 
-    bool empty() {
-        assert(_used >= 0);
-        return (_used == 0);
+    // Mark a reserved slot as filled. It becomes visible to the consumer
+    // once every slot that was reserved before it has been filled too.
+    void publish(BufferTuple* buf) {
+        {
+            lock_guard<mutex> lock(_mutex);
+            assert(_reserved > 0);
+            _filled[buf - &_bufs[0]] = true;
+            int pos = (_readPos + _used) % _count;
+            while ((_reserved > 0) && (_filled[pos] == true)) {
+                _filled[pos] = false;
+                _reserved--;
+                _used++;
+                advance(pos);
+            }
+        }
+        _nonEmpty.notify_all();
     }
 
-    bool full() {
-        assert(_used <= _count);
-        return (_used == _count);
+    // Wait for a published slot and hand it to the consumer. The slot stays
+    // in use until release() is called. Returns 0 if the pool was aborted
+    // while waiting.
+    BufferTuple* acquire() {
+        unique_lock<mutex> lock(_mutex);
+        while ((_used == 0) && (_aborted == false)) {
+            _nonEmpty.wait(lock);
+        }
+        if (_aborted == true) {
+            return 0;
+        }
+        return &_bufs[_readPos];
     }
 
-    mutex& getMutex() {
-        return _mutex;
+    // Return the oldest published slot to the producer.
+    void release() {
+        {
+            lock_guard<mutex> lock(_mutex);
+            assert(_used > 0);
+            _used--;
+            advance(_readPos);
+        }
+        _nonFull.notify_all();
     }
 
-    void waitForNonEmpty(unique_lock<mutex>& lock) {
-        _nonEmpty.wait(lock);
+    // Wake up any thread blocked in reserve() or acquire() and make further
+    // calls to them fail.
+    void abort() {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _aborted = true;
+        }
+        _nonFull.notify_all();
+        _nonEmpty.notify_all();
     }
 
-    void waitForNonFull(unique_lock<mutex>& lock) {
-        _nonFull.wait(lock);
+    // Drop every buffer and undo abort(). Only safe while no thread holds a
+    // reservation or an acquired buffer.
+    void reset() {
+        lock_guard<mutex> lock(_mutex);
+        _used = 0;
+        _reserved = 0;
+        _readPos = 0;
+        _reservePos = 0;
+        _aborted = false;
+        std::fill(_filled.begin(), _filled.end(), false);
     }
 
-    void signalNonEmpty() {
-        _nonEmpty.notify_all();
+    bool empty() {
+        lock_guard<mutex> lock(_mutex);
+        assert(_used >= 0);
+        return (_used == 0);
     }
 
-    void signalNonFull() {
-        _nonFull.notify_all();
+    bool full() {
+        lock_guard<mutex> lock(_mutex);
+        assert(_used + _reserved <= _count);
+        return (_used + _reserved == _count);
     }
 
 protected:
@@ -285,10 +371,17 @@ protected:
 
 protected:
     int                         _count;
+    // Number of slots published but not yet released.
     int                         _used;
+    // Number of slots reserved but not yet published.
+    int                         _reserved;
     vector<BufferTuple>         _bufs;
+    // Reserved slots that have been filled but are waiting for an earlier
+    // reservation to be filled.
+    vector<bool>                _filled;
     int                         _readPos;
-    int                         _writePos;
+    int                         _reservePos;
+    bool                        _aborted;
     mutex                       _mutex;
     condition_variable          _nonFull;
     condition_variable          _nonEmpty;
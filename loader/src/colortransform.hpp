@@ -0,0 +1,151 @@
+/*
+ Copyright 2016 Nervana Systems Inc.
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_AVX2_KERNELS 1
+#endif
+
+/*
+
+Affine color transform of an interleaved 3 channel image into planes.
+
+Every output channel c is computed from the input channels of the same pixel
+as m[c][0] * p[0] + m[c][1] * p[1] + m[c][2] * p[2] + m[c][3], rounded to the
+nearest integer and saturated to 0..255. Output channel c is written to its
+own plane. The image augmentations use this to apply all of their photometric
+distortions and the split into planes in one pass over the pixels.
+
+Runs of 16 pixels are done with AVX2 when the CPU supports it. The rest fall
+back to scalar code, which computes exactly the same thing.
+
+*/
+
+class ColorTransform {
+public:
+    // Transform a rows x cols image whose rows start srcStride bytes apart.
+    // The planes start planeSize bytes apart from dst and hold rows of cols
+    // bytes each.
+    static void run(const uint8_t* src, int rows, int cols, long srcStride,
+                    const float m[3][4], uint8_t* dst, long planeSize) {
+        if (srcStride == 3L * cols) {
+            // Contiguous rows can be treated as one long row.
+            cols *= rows;
+            rows = 1;
+        }
+        for (int r = 0; r < rows; r++) {
+            const uint8_t* in = src + r * srcStride;
+            uint8_t* out = dst + (long) r * cols;
+            int done = 0;
+#if HAS_AVX2_KERNELS
+            if (hasAvx2() == true) {
+                done = cols - cols % 16;
+                avx2(in, done, m, out, planeSize);
+            }
+#endif
+            scalar(in + 3 * done, cols - done, m, out + done, planeSize);
+        }
+    }
+
+private:
+    static void scalar(const uint8_t* src, int count, const float m[3][4],
+                       uint8_t* dst, long planeSize) {
+        for (int i = 0; i < count; i++) {
+            float b = src[3 * i];
+            float g = src[3 * i + 1];
+            float r = src[3 * i + 2];
+            for (int c = 0; c < 3; c++) {
+                float value = m[c][0] * b + m[c][1] * g + m[c][2] * r + m[c][3];
+                long result = lrintf(value);
+                dst[c * planeSize + i] = (result < 0) ? 0 :
+                                         (result > 255) ? 255 : result;
+            }
+        }
+    }
+
+#if HAS_AVX2_KERNELS
+    static bool hasAvx2() {
+        static bool result = (__builtin_cpu_init(),
+                              __builtin_cpu_supports("avx2") != 0);
+        return result;
+    }
+
+    // Widen 8 bytes to floats.
+    __attribute__((target("avx2")))
+    static __m256 widen(__m128i bytes) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+    }
+
+    // Same order of operations as scalar(), so that rounding matches.
+    __attribute__((target("avx2")))
+    static __m256i apply(const float row[4], __m256 b, __m256 g, __m256 r) {
+        __m256 value = _mm256_add_ps(
+            _mm256_mul_ps(_mm256_set1_ps(row[0]), b),
+            _mm256_mul_ps(_mm256_set1_ps(row[1]), g));
+        value = _mm256_add_ps(value, _mm256_mul_ps(_mm256_set1_ps(row[2]), r));
+        value = _mm256_add_ps(value, _mm256_set1_ps(row[3]));
+        return _mm256_cvtps_epi32(value);
+    }
+
+    // Transform count pixels, where count is a multiple of 16.
+    __attribute__((target("avx2")))
+    static void avx2(const uint8_t* src, int count, const float m[3][4],
+                     uint8_t* dst, long planeSize) {
+        // Gather every third byte of 48 into 16, for each channel.
+        const __m128i mask[3][3] = {
+            {_mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+             _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1),
+             _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)},
+            {_mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+             _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+             _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)},
+            {_mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+             _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1),
+             _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)}};
+        for (int i = 0; i < count; i += 16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*) (src + 3 * i));
+            __m128i a1 = _mm_loadu_si128((const __m128i*) (src + 3 * i + 16));
+            __m128i a2 = _mm_loadu_si128((const __m128i*) (src + 3 * i + 32));
+            __m256 lo[3];
+            __m256 hi[3];
+            for (int c = 0; c < 3; c++) {
+                __m128i bytes = _mm_or_si128(
+                    _mm_or_si128(_mm_shuffle_epi8(a0, mask[c][0]),
+                                 _mm_shuffle_epi8(a1, mask[c][1])),
+                    _mm_shuffle_epi8(a2, mask[c][2]));
+                lo[c] = widen(bytes);
+                hi[c] = widen(_mm_srli_si128(bytes, 8));
+            }
+            for (int c = 0; c < 3; c++) {
+                __m256i first = apply(m[c], lo[0], lo[1], lo[2]);
+                __m256i second = apply(m[c], hi[0], hi[1], hi[2]);
+                // Packing works within 128 bit lanes, so put the four
+                // groups of four values back in order before narrowing.
+                __m256i words = _mm256_permute4x64_epi64(
+                    _mm256_packs_epi32(first, second), 0xD8);
+                __m128i bytes = _mm_packus_epi16(
+                    _mm256_castsi256_si128(words),
+                    _mm256_extracti128_si256(words, 1));
+                _mm_storeu_si128((__m128i*) (dst + c * planeSize + i), bytes);
+            }
+        }
+    }
+#endif
+};
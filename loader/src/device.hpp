@@ -19,35 +19,37 @@
 
 enum DeviceType { CPU=0, GPU=1 };
 
+// This must be kept in sync with dataloader.py.
 class DeviceParams {
 public:
-    DeviceParams(int type, int id) : _type(type), _id(id) {}
+    DeviceParams(int type, int id, int count)
+    : _type(type), _id(id), _count(count) {}
 
 public:
     int                         _type;
     int                         _id;
+    // Number of buffers in the device ring.
+    int                         _count;
 };
 
 class CpuParams : public DeviceParams {
 public:
-    CpuParams(int type, int id, char* data[2], char* targets[2], int* meta[2])
-    : DeviceParams(type, id) {
-        for (int i = 0; i < 2; i++) {
-            _data[i] = data[i];
-            _targets[i] = targets[i];
-            _meta[i] = meta[i];
-        }
+    CpuParams(int type, int id, int count,
+              char** data, char** targets, int** meta)
+    : DeviceParams(type, id, count),
+      _data(data), _targets(targets), _meta(meta) {
     }
 
 public:
-    char*                       _data[2];
-    char*                       _targets[2];
-    int*                        _meta[2];
+    // Each of these points to an array of _count buffers.
+    char**                      _data;
+    char**                      _targets;
+    int**                       _meta;
 };
 
 class Device {
 public:
-    Device(int type) : _type(type) {}
+    Device(int type, int count) : _type(type), _count(count) {}
     virtual ~Device() {};
     virtual int init() = 0;
     virtual void copyData(int idx, CharBuffer* buf) = 0;
@@ -56,10 +58,26 @@ public:
     virtual void copyDataBack(int idx, CharBuffer* buf) = 0;
     virtual void copyLabelsBack(int idx, CharBuffer* buf) = 0;
 
+    // Pointers to device buffers that the CPU can write to directly. Devices
+    // that need data to be staged and copied over return 0.
+    virtual char* getDataPtr(int idx) {
+        return 0;
+    }
+
+    virtual char* getTargetsPtr(int idx) {
+        return 0;
+    }
+
+    virtual int* getMetaPtr(int idx) {
+        return 0;
+    }
+
     static Device* create(DeviceParams* params);
 
 public:
     int                         _type;
+    // Number of buffers in the device ring.
+    int                         _count;
 };
 
 #if HAS_GPU
@@ -82,17 +100,19 @@ void check(T err, T sval, const char* const func,
 
 class GpuParams : public DeviceParams {
 public:
-    CUdeviceptr                 _data[2];
-    CUdeviceptr                 _targets[2];
-    CUdeviceptr                 _meta[2];
+    // Each of these points to an array of _count buffers.
+    CUdeviceptr*                _data;
+    CUdeviceptr*                _targets;
+    CUdeviceptr*                _meta;
 };
 
 class Gpu : public Device {
 public:
-    Gpu(int id, int dataSize, int targetSize, int metaSize)
-    : Device(GPU), _alloc(true), _id(id) {
+    Gpu(int id, int count, int dataSize, int targetSize, int metaSize)
+    : Device(GPU, count), _data(count), _targets(count), _meta(count),
+      _alloc(true), _id(id) {
         init();
-        for (int i = 0; i < 2; i++) {
+        for (int i = 0; i < count; i++) {
             checkDriverErrors(cuMemAlloc(&_data[i], dataSize));
             checkDriverErrors(cuMemAlloc(&_targets[i], targetSize));
             checkDriverErrors(cuMemAlloc(&_meta[i], metaSize * sizeof(int)));
@@ -100,17 +120,16 @@ public:
     }
 
     Gpu(GpuParams* params)
-    : Device(GPU), _alloc(false), _id(params->_id) {
-        for (int i = 0; i < 2; i++) {
-            _data[i] = params->_data[i];
-            _targets[i] = params->_targets[i];
-            _meta[i] = params->_meta[i];
-        }
+    : Device(GPU, params->_count),
+      _data(params->_data, params->_data + params->_count),
+      _targets(params->_targets, params->_targets + params->_count),
+      _meta(params->_meta, params->_meta + params->_count),
+      _alloc(false), _id(params->_id) {
     }
 
     virtual ~Gpu() {
         if (_alloc == true) {
-            for (int i = 0; i < 2; i++) {
+            for (int i = 0; i < _count; i++) {
                 cuMemFree(_data[i]);
                 cuMemFree(_targets[i]);
                 cuMemFree(_meta[i]);
@@ -158,9 +177,9 @@ private:
     }
 
 private:
-    CUdeviceptr                 _data[2];
-    CUdeviceptr                 _targets[2];
-    CUdeviceptr                 _meta[2];
+    vector<CUdeviceptr>         _data;
+    vector<CUdeviceptr>         _targets;
+    vector<CUdeviceptr>         _meta;
     bool                        _alloc;
     int                         _id;
 };
@@ -168,10 +187,11 @@ private:
 
 class Cpu : public Device {
 public:
-    Cpu(int id, int dataSize, int targetSize, int metaSize)
-    : Device(CPU), _alloc(true) {
+    Cpu(int id, int count, int dataSize, int targetSize, int metaSize)
+    : Device(CPU, count), _data(count), _targets(count), _meta(count),
+      _alloc(true) {
         init();
-        for (int i = 0; i < 2; i++) {
+        for (int i = 0; i < count; i++) {
             _data[i] = new char[dataSize];
             _targets[i] = new char[targetSize];
             _meta[i] = new int[metaSize];
@@ -179,17 +199,16 @@ public:
     }
 
     Cpu(CpuParams* params)
-    : Device(CPU), _alloc(false) {
-        for (int i = 0; i < 2; i++) {
-            _data[i] = params->_data[i];
-            _targets[i] = params->_targets[i];
-            _meta[i] = params->_meta[i];
-        }
+    : Device(CPU, params->_count),
+      _data(params->_data, params->_data + params->_count),
+      _targets(params->_targets, params->_targets + params->_count),
+      _meta(params->_meta, params->_meta + params->_count),
+      _alloc(false) {
     }
 
     virtual ~Cpu() {
         if (_alloc == true) {
-            for (int i = 0; i < 2; i++) {
+            for (int i = 0; i < _count; i++) {
                 delete[] _data[i];
                 delete[] _targets[i];
                 delete[] _meta[i];
@@ -223,10 +242,22 @@ public:
         memcpy(buf->_data, _targets[idx], buf->_totalLen);
     }
 
+    char* getDataPtr(int idx) {
+        return _data[idx];
+    }
+
+    char* getTargetsPtr(int idx) {
+        return _targets[idx];
+    }
+
+    int* getMetaPtr(int idx) {
+        return _meta[idx];
+    }
+
 private:
-    char*                       _data[2];
-    char*                       _targets[2];
-    int*                        _meta[2];
+    vector<char*>               _data;
+    vector<char*>               _targets;
+    vector<int*>                _meta;
     bool                        _alloc;
 };
 
@@ -16,14 +16,24 @@
 #pragma once
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <fstream>
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
 #include "media.hpp"
+#include "colortransform.hpp"
+#if HAS_JPEGLIB
+#include "jpeg.hpp"
+#endif
+
+#define RAW_IMAGE_MAGIC     "NRAW"
 
 using cv::Mat;
 using cv::Rect;
@@ -62,7 +72,7 @@ public:
                 int rotateMin, int rotateMax,
                 int aspectRatio, bool subtractMean,
                 int redMean, int greenMean, int blueMean,
-                int grayMean)
+                int grayMean, int decodeCacheMB = 0)
     : MediaParams(IMAGE),
       _channelCount(channelCount),
       _height(height), _width(width),
@@ -72,7 +82,7 @@ public:
       _rotateMin(rotateMin), _rotateMax(rotateMax),
       _aspectRatio(aspectRatio), _subtractMean(true),
       _redMean(redMean), _greenMean(greenMean), _blueMean(blueMean),
-      _grayMean(grayMean) {
+      _grayMean(grayMean), _decodeCacheMB(decodeCacheMB), _decodeCache(0) {
         if (_rotateMax < _rotateMin) {
             throw std::runtime_error("Max angle is less than min angle");
         }
@@ -199,15 +209,19 @@ public:
     int                         _blueMean;
     int                         _grayMean;
     float                       _colorNoiseStd;
+    // Memory budget for decoded images. No caching if 0.
+    int                         _decodeCacheMB;
+    // DecodeCache shared by every Image created with these params.
+    void*                       _decodeCache;
 };
 
 class ImageIngestParams : public MediaParams {
 public:
     ImageIngestParams(bool resizeAtIngest, bool lossyEncoding,
-                      int sideMin, int sideMax)
+                      int sideMin, int sideMax, bool rawPixels = false)
     : MediaParams(IMAGE),
       _resizeAtIngest(resizeAtIngest), _lossyEncoding(lossyEncoding),
-      _sideMin(sideMin), _sideMax(sideMax) {}
+      _sideMin(sideMin), _sideMax(sideMax), _rawPixels(rawPixels) {}
 
 public:
     bool                        _resizeAtIngest;
@@ -216,7 +230,200 @@ public:
     int                         _sideMin;
     // Maximum value of the short side
     int                         _sideMax;
+    // Store decoded pixels instead of an encoded image
+    bool                        _rawPixels;
+};
+
+// Images that were stored as raw pixels at ingest start with this header.
+// The pixels follow row by row, with the channels of each pixel interleaved
+// in the order that OpenCV decodes them (BGR).
+class RawImageHeader {
+public:
+    RawImageHeader() : _height(0), _width(0), _channelCount(0) {
+        memcpy(_magic, RAW_IMAGE_MAGIC, sizeof(_magic));
+    }
 
+    // Return true and fill in the header if item holds raw pixels.
+    bool read(const char* item, int itemSize) {
+        if ((itemSize < (int) sizeof(*this)) ||
+            (memcmp(item, RAW_IMAGE_MAGIC, sizeof(_magic)) != 0)) {
+            return false;
+        }
+        memcpy(this, item, sizeof(*this));
+        if ((_height <= 0) || (_width <= 0) ||
+            ((_channelCount != 1) && (_channelCount != 3)) ||
+            (itemSize - (int) sizeof(*this) <
+             _height * _width * _channelCount)) {
+            throw std::runtime_error("Damaged raw image");
+        }
+        return true;
+    }
+
+public:
+    char                        _magic[4];
+    int                         _height;
+    int                         _width;
+    int                         _channelCount;
+};
+
+// Decoded images shared by the decode threads, so that an image is only
+// decoded once as long as it fits. Images are looked up by a hash of their
+// encoded bytes. Each entry keeps a copy of the encoded bytes, which are
+// compared before the entry is used, so that a hash collision can never hand
+// out the pixels of another image. The least recently used entries are
+// dropped to stay within the budget. The cached images must not be modified.
+class DecodeCache {
+public:
+    explicit DecodeCache(size_t budget)
+    : _budget(budget), _used(0), _users(0) {
+    }
+
+    void attach() {
+        _users++;
+    }
+
+    // Return true if this was the last user.
+    bool detach() {
+        return --_users == 0;
+    }
+
+    static uint64_t key(const char* item, int itemSize, bool grayscale) {
+        uint64_t result = 0x9E3779B97F4A7C15ULL ^ ((uint64_t) itemSize << 1) ^
+                          (grayscale ? 1 : 0);
+        int i = 0;
+        for (; i + 8 <= itemSize; i += 8) {
+            uint64_t word;
+            memcpy(&word, item + i, sizeof(word));
+            result = mix(result ^ word);
+        }
+        for (; i < itemSize; i++) {
+            result = mix(result ^ (uchar) item[i]);
+        }
+        return result;
+    }
+
+    bool get(uint64_t key, const char* item, int itemSize, Mat* dst) {
+        Mat encoded;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _index.find(key);
+            if ((it == _index.end()) ||
+                (it->second->_encoded.cols != itemSize)) {
+                return false;
+            }
+            _entries.splice(_entries.begin(), _entries, it->second);
+            encoded = it->second->_encoded;
+            *dst = it->second->_image;
+        }
+        // The entry may be dropped once the lock is released, but the
+        // matrices that were handed out stay valid.
+        if (memcmp(encoded.data, item, itemSize) != 0) {
+            *dst = Mat();
+            return false;
+        }
+        return true;
+    }
+
+    void put(uint64_t key, const char* item, int itemSize, const Mat& image) {
+        size_t size = image.total() * image.elemSize() + itemSize;
+        if (size > _budget) {
+            return;
+        }
+        Mat encoded(1, itemSize, CV_8UC1);
+        memcpy(encoded.data, item, itemSize);
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            // Another thread got here first or the hash collided.
+            remove(it->second);
+        }
+        _entries.push_front(Entry{key, size, encoded, image});
+        _index[key] = _entries.begin();
+        _used += size;
+        while (_used > _budget) {
+            remove(std::prev(_entries.end()));
+        }
+    }
+
+private:
+    class Entry {
+    public:
+        uint64_t                _key;
+        // Bytes used by the entry.
+        size_t                  _size;
+        Mat                     _encoded;
+        Mat                     _image;
+    };
+
+    static uint64_t mix(uint64_t value) {
+        value *= 0xFF51AFD7ED558CCDULL;
+        return value ^ (value >> 32);
+    }
+
+    void remove(std::list<Entry>::iterator entry) {
+        _used -= entry->_size;
+        _index.erase(entry->_key);
+        _entries.erase(entry);
+    }
+
+private:
+    size_t                      _budget;
+    size_t                      _used;
+    // Number of Image objects using the cache.
+    int                         _users;
+    // Most recently used first.
+    std::list<Entry>            _entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> _index;
+    std::mutex                  _mutex;
+};
+
+// Grow-only buffers that an Image reuses for its intermediate images, so that
+// transforming an image does not allocate memory once the buffers are large
+// enough. Every kind of intermediate image has a slot of its own. An image
+// taken from a slot is only valid until the slot is used again.
+class ImageWorkspace {
+public:
+    enum Slot {
+        DECODED,
+        SHRUNK,
+        OUTPUT,
+        SCRATCH,
+        SLOT_COUNT
+    };
+
+    ImageWorkspace() {
+        for (int i = 0; i < SLOT_COUNT; i++) {
+            _buffers[i] = 0;
+            _sizes[i] = 0;
+        }
+    }
+
+    virtual ~ImageWorkspace() {
+        for (int i = 0; i < SLOT_COUNT; i++) {
+            delete[] _buffers[i];
+        }
+    }
+
+    // Make sure that a slot can hold size bytes without growing.
+    void reserve(Slot slot, size_t size) {
+        if (size <= _sizes[slot]) {
+            return;
+        }
+        delete[] _buffers[slot];
+        // Allocate a bit more to minimize reallocations.
+        size += size / 8;
+        _buffers[slot] = new char[size];
+        _sizes[slot] = size;
+    }
+
+    Mat get(Slot slot, int rows, int cols, int type) {
+        reserve(slot, (size_t) rows * cols * CV_ELEM_SIZE(type));
+        return Mat(rows, cols, type, _buffers[slot]);
+    }
+
+private:
+    char*                       _buffers[SLOT_COUNT];
+    size_t                      _sizes[SLOT_COUNT];
 };
 
 void resizeInput(vector<char> &jpgdata, int maxDim){
@@ -245,17 +452,38 @@ class Image: public Media {
 friend class Video;
 public:
     Image(ImageParams *params, ImageIngestParams* ingestParams, int id)
-    : _params(params), _ingestParams(ingestParams), _rng(id) {
+    : _params(params), _ingestParams(ingestParams), _rng(id),
+      _distortCrop(false), _decodeCache(0) {
         assert(params->_mtype == IMAGE);
         assert((params->_channelCount == 1) || (params->_channelCount == 3));
         _innerSize = _params->getSize();
         _numPixels = _innerSize.area();
+        _workspace.reserve(ImageWorkspace::OUTPUT,
+                           (size_t) _numPixels * params->_channelCount);
+        if (params->_decodeCacheMB > 0) {
+            // Media objects are created and deleted by a single thread.
+            if (params->_decodeCache == 0) {
+                params->_decodeCache =
+                    new DecodeCache((size_t) params->_decodeCacheMB << 20);
+            }
+            _decodeCache = reinterpret_cast<DecodeCache*>(params->_decodeCache);
+            _decodeCache->attach();
+        }
+    }
+
+    virtual ~Image() {
+        if ((_decodeCache != 0) && (_decodeCache->detach() == true)) {
+            delete _decodeCache;
+            _params->_decodeCache = 0;
+        }
     }
 
     void transform(char* item, int itemSize, char* buf, int bufSize, int* meta) {
         Mat decodedImage;
-        decode(item, itemSize, &decodedImage);
-        createRandomAugParams(decodedImage.size());
+        if (decodeForCrop(item, itemSize, &decodedImage) == false) {
+            decodeCached(item, itemSize, &decodedImage, false);
+            createRandomAugParams(decodedImage.size());
+        }
         transformDecodedImage(decodedImage, buf, bufSize);
     }
 
@@ -264,12 +492,12 @@ public:
                    char* datumBuf, int datumLen,
                    char* targetBuf, int targetLen) {
         Mat decodedDatum;
-        decode(encDatum, encDatumLen, &decodedDatum);
+        decodeCached(encDatum, encDatumLen, &decodedDatum, false);
         createRandomAugParams(decodedDatum.size());
         transformDecodedImage(decodedDatum, datumBuf, datumLen);
         Mat decodedTarget;
         // Assume grayscale masks for now.
-        decodeGrayscale(encTarget, encTargetLen, &decodedTarget);
+        decodeCached(encTarget, encTargetLen, &decodedTarget, true);
         transformDecodedImage(decodedTarget, targetBuf, targetLen);
     }
 
@@ -292,7 +520,16 @@ public:
         if (_ingestParams == 0) {
             return;
         }
+        if ((_ingestParams->_resizeAtIngest == false) &&
+            (_ingestParams->_rawPixels == false)) {
+            return;
+        }
+
+        // Decode
+        Mat decodedImage;
+        decode(*dataBuf, *dataLen, &decodedImage, true);
         if (_ingestParams->_resizeAtIngest == false) {
+            storeRaw(decodedImage, dataBuf, dataBufLen, dataLen);
             return;
         }
         if ((_ingestParams->_sideMin <= 0) && (_ingestParams->_sideMax <= 0)) {
@@ -302,16 +539,15 @@ public:
             throw std::runtime_error("Invalid ingest parameters. Cannot resize.");
         }
 
-        // Decode
-        Mat decodedImage;
-        decode(*dataBuf, *dataLen, &decodedImage);
-
         // Resize
         int width = decodedImage.cols;
         int height = decodedImage.rows;
         int shortSide = std::min(width, height);
         if ((shortSide >= _ingestParams->_sideMin) &&
             (shortSide <= _ingestParams->_sideMax)) {
+            if (_ingestParams->_rawPixels == true) {
+                storeRaw(decodedImage, dataBuf, dataBufLen, dataLen);
+            }
             return;
         }
 
@@ -336,6 +572,10 @@ public:
         Size2i size(width, height);
         Mat resizedImage;
         resize(decodedImage, resizedImage, size);
+        if (_ingestParams->_rawPixels == true) {
+            storeRaw(resizedImage, dataBuf, dataBufLen, dataLen);
+            return;
+        }
 
         // Re-encode
         vector<int> param;
@@ -360,6 +600,22 @@ public:
         *dataLen = output.size();
     }
 
+    string ingestSignature() {
+        if ((_ingestParams == 0) ||
+            ((_ingestParams->_resizeAtIngest == false) &&
+             (_ingestParams->_rawPixels == false))) {
+            return "";
+        }
+        stringstream ss;
+        ss << "image channels " << _params->_channelCount
+           << " resize " << _ingestParams->_resizeAtIngest
+           << " lossy " << _ingestParams->_lossyEncoding
+           << " side " << _ingestParams->_sideMin
+           << " " << _ingestParams->_sideMax
+           << " raw " << _ingestParams->_rawPixels;
+        return ss.str();
+    }
+
     void save_binary(char *filn, char* item, int itemSize, char* buf) {
         ofstream file(filn, ofstream::out | ofstream::binary);
         file.write((char*)(&itemSize), sizeof(int));
@@ -368,17 +624,53 @@ public:
     }
 
 private:
+    // These leave dst empty if the image could not be decoded.
     void decodeGrayscale(char* item, int itemSize, Mat* dst) {
         Mat image(1, itemSize, CV_8UC1, item);
-        cv::imdecode(image, CV_LOAD_IMAGE_GRAYSCALE, dst);
+        if (cv::imdecode(image, CV_LOAD_IMAGE_GRAYSCALE, dst).empty() == true) {
+            *dst = Mat();
+        }
     }
 
     void decodeColor(char* item, int itemSize, Mat* dst) {
         Mat image(1, itemSize, CV_8UC3, item);
-        cv::imdecode(image, CV_LOAD_IMAGE_COLOR, dst);
+        if (cv::imdecode(image, CV_LOAD_IMAGE_COLOR, dst).empty() == true) {
+            *dst = Mat();
+        }
     }
 
-    void decode(char* item, int itemSize, Mat* dst) {
+    // Images that are to be kept are never taken from the workspace.
+    void decode(char* item, int itemSize, Mat* dst, bool keep) {
+        RawImageHeader header;
+        if (header.read(item, itemSize) == true) {
+            // Nothing to decode. Copy the pixels, since the augmentations
+            // work in place and item may point into a shared archive.
+            Mat raw(header._height, header._width,
+                    CV_8UC(header._channelCount), item + sizeof(header));
+            if (keep == false) {
+                *dst = _workspace.get(ImageWorkspace::DECODED, raw.rows,
+                                      raw.cols, CV_8UC(_params->_channelCount));
+            }
+            if (header._channelCount == _params->_channelCount) {
+                raw.copyTo(*dst);
+            } else if (_params->_channelCount == 1) {
+                cv::cvtColor(raw, *dst, CV_BGR2GRAY);
+            } else {
+                cv::cvtColor(raw, *dst, CV_GRAY2BGR);
+            }
+            return;
+        }
+#if CV_MAJOR_VERSION >= 3
+        if (keep == false) {
+            // cv::imdecode() decodes into the destination without allocating
+            // if the image has the same shape as the previous one. OpenCV 2
+            // returns the untouched destination if it cannot decode the
+            // image, which would pass off the previous image as this one.
+            *dst = _workspace.get(ImageWorkspace::DECODED, _decodedSize.height,
+                                  _decodedSize.width,
+                                  CV_8UC(_params->_channelCount));
+        }
+#endif
         if (_params->_channelCount == 1) {
             decodeGrayscale(item, itemSize, dst);
         } else if (_params->_channelCount == 3) {
@@ -388,52 +680,254 @@ private:
             ss << "Unsupported number of channels in image: " << _params->_channelCount;
             throw std::runtime_error(ss.str());
         }
+        if (keep == false) {
+            _decodedSize = dst->size();
+        }
     }
 
-    void transformDecodedImage(const Mat& decodedImage, char* buf, int bufSize){
-        Mat rotatedImage;
-        rotate(decodedImage, rotatedImage, _augParams.angle);
-        Mat croppedImage = rotatedImage(_augParams.cropBox);
+    // Decode through the shared cache if there is one. The result may be
+    // shared with other threads and must not be modified.
+    void decodeCached(char* item, int itemSize, Mat* dst, bool grayscale) {
+        uint64_t key = 0;
+        if (_decodeCache != 0) {
+            key = DecodeCache::key(item, itemSize, grayscale);
+            if (_decodeCache->get(key, item, itemSize, dst) == true) {
+                return;
+            }
+        }
+        if (grayscale == true) {
+            decodeGrayscale(item, itemSize, dst);
+        } else {
+            decode(item, itemSize, dst, _decodeCache != 0);
+        }
+        // Images that could not be decoded are tried again next time.
+        if ((_decodeCache != 0) && (dst->empty() == false)) {
+            _decodeCache->put(key, item, itemSize, *dst);
+        }
+    }
 
-        Mat resizedImage;
+    // Decode a JPEG image at the smallest scale that still covers the crop box
+    // at the output resolution. Unless the image is to be rotated, only the
+    // part of the image around the crop box is decoded. The augmentation
+    // params are drawn from the size in the image header and the crop box is
+    // then moved and scaled to match the decoded image. Returns false without
+    // drawing the params if the image is not a JPEG image, or if it is to be
+    // shown in another orientation than it is stored in, which is left to
+    // cv::imdecode().
+    bool decodeForCrop(char* item, int itemSize, Mat* dst) {
+#if HAS_JPEGLIB
+        // Cached images are kept at full size.
+        if ((_decodeCache != 0) ||
+            (_jpeg.readHeader(item, itemSize) == false) ||
+            (_jpeg.orientation() != 1)) {
+            return false;
+        }
+        Size2i size(_jpeg.width(), _jpeg.height());
+        createRandomAugParams(size);
+        Rect& box = _augParams.cropBox;
+        int scale = 8;
+        while ((scale > 1) &&
+               ((box.width / scale < _innerSize.width) ||
+                (box.height / scale < _innerSize.height))) {
+            scale /= 2;
+        }
+        // Rotation samples outside of the crop box.
+        bool region = (JpegDecoder::canCrop() == true) &&
+                      (_augParams.angle == 0) && (box.area() < size.area());
+        // Whatever part of the image is decoded fits in here.
+        _workspace.reserve(ImageWorkspace::DECODED,
+                           (size_t) size.area() * _params->_channelCount);
+        if (_jpeg.start(scale, _params->_channelCount) == true) {
+            Rect scaled(box.x / scale, box.y / scale, 0, 0);
+            scaled.width = std::min(box.width / scale,
+                                    _jpeg.outputWidth() - scaled.x);
+            scaled.height = std::min(box.height / scale,
+                                     _jpeg.outputHeight() - scaled.y);
+            if (region == true) {
+                if (decodeRegion(scaled, dst) == true) {
+                    return true;
+                }
+            } else {
+                *dst = _workspace.get(ImageWorkspace::DECODED,
+                                      _jpeg.outputHeight(), _jpeg.outputWidth(),
+                                      CV_8UC(_params->_channelCount));
+                if (_jpeg.read(dst->data, dst->step) == true) {
+                    box = scaled;
+                    return true;
+                }
+            }
+        }
+        // libjpeg could not decode it.
+        decode(item, itemSize, dst, false);
+        if (dst->size() != size) {
+            createRandomAugParams(dst->size());
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
 
-        // Perform photometric distortions in smaller spatial domain
-        if (_augParams.cropBox.area() < _numPixels) {
-            cbsjitter(croppedImage, _augParams.cbs);
-            lighting(croppedImage, _augParams.colornoise);
-            resize(croppedImage, resizedImage, _innerSize);
+#if HAS_JPEGLIB
+    // Decode the part of the image under the given crop box, after
+    // _jpeg.start(). A pixel is added on every side, so that chroma
+    // upsampling at the edges of the crop box sees the same neighbors as in
+    // a full decode.
+    bool decodeRegion(const Rect& box, Mat* dst) {
+        int left = std::max(0, box.x - 1);
+        int top = std::max(0, box.y - 1);
+        int right = std::min(_jpeg.outputWidth(), box.x + box.width + 1);
+        int bottom = std::min(_jpeg.outputHeight(), box.y + box.height + 1);
+        int columns = right - left;
+        if (_jpeg.crop(left, columns) == false) {
+            return false;
+        }
+        *dst = _workspace.get(ImageWorkspace::DECODED, bottom - top, columns,
+                              CV_8UC(_params->_channelCount));
+        if (_jpeg.readRows(top, bottom - top, dst->data, dst->step) == false) {
+            return false;
+        }
+        _augParams.cropBox = Rect(box.x - left, box.y - top,
+                                  box.width, box.height);
+        return true;
+    }
+#endif
+
+    void storeRaw(const Mat& img, char** dataBuf, int* dataBufLen, int* dataLen) {
+        RawImageHeader header;
+        header._height = img.rows;
+        header._width = img.cols;
+        header._channelCount = img.channels();
+        int len = sizeof(header) + img.total() * img.channels();
+        if (*dataBufLen < len) {
+            delete[] *dataBuf;
+            *dataBuf = new char[len];
+            *dataBufLen = len;
+        }
+        memcpy(*dataBuf, &header, sizeof(header));
+        Mat dst(img.rows, img.cols, img.type(), *dataBuf + sizeof(header));
+        img.copyTo(dst);
+        *dataLen = len;
+    }
+
+    void transformDecodedImage(const Mat& decodedImage, char* buf, int bufSize){
+        Mat finalImage;
+        if (_augParams.angle == 0) {
+            cropAndResize(decodedImage, finalImage);
         } else {
-            resize(croppedImage, resizedImage, _innerSize);
-            cbsjitter(croppedImage, _augParams.cbs);
-            lighting(croppedImage, _augParams.colornoise);
+            warp(decodedImage, finalImage);
         }
 
-        Mat *finalImage = &resizedImage;
-        Mat flippedImage;
-        if (_augParams.flip) {
-            cv::flip(resizedImage, flippedImage, 1);
-            finalImage = &flippedImage;
+        // Perform photometric distortions in the output domain
+        bool distort = (_distortCrop == true) &&
+                       ((_params->_contrastMin != _params->_contrastMax) ||
+                        (_params->_colorNoiseStd != 0.0));
+        if ((distort == true) && (finalImage.channels() == 3)) {
+            distortAndSplit(finalImage, buf, bufSize);
+            return;
+        }
+        if ((distort == true) && (_decodeCache != 0) &&
+            (finalImage.datastart == decodedImage.datastart)) {
+            // The photometric distortions work in place. Keep them off the
+            // cached image.
+            Mat copy = _workspace.get(ImageWorkspace::SCRATCH, finalImage.rows,
+                                      finalImage.cols, finalImage.type());
+            finalImage.copyTo(copy);
+            finalImage = copy;
         }
+        cbsjitter(finalImage, _augParams.cbs);
+        lighting(finalImage, _augParams.colornoise);
 
-        split(*finalImage, buf, bufSize);
+        split(finalImage, buf, bufSize);
     }
 
-    void rotate(const Mat& input, Mat& output, int angle) {
-        if (angle == 0) {
-            output = input;
-        } else {
-            Point2i pt(input.cols / 2, input.rows / 2);
-            Mat rot = cv::getRotationMatrix2D(pt, angle, 1.0);
-            cv::warpAffine(input, output, rot, input.size());
+    // Crop, resize and flip without rotating. The output is a view of the
+    // input if no resizing or flipping is needed.
+    void cropAndResize(const Mat& input, Mat& output) {
+        Mat croppedImage = input(_augParams.cropBox);
+        if ((croppedImage.size() == _innerSize) && (_augParams.flip == false)) {
+            output = croppedImage;
+            return;
+        }
+        output = _workspace.get(ImageWorkspace::OUTPUT, _innerSize.height,
+                                _innerSize.width, input.type());
+        if (croppedImage.size() == _innerSize) {
+            cv::flip(croppedImage, output, 1);
+            return;
+        }
+        int inter = croppedImage.size().area() < _numPixels ? CV_INTER_CUBIC : CV_INTER_AREA;
+        cv::resize(croppedImage, output, _innerSize, 0, 0, inter);
+        if (_augParams.flip) {
+            cv::flip(output, output, 1);
         }
     }
 
+    // Rotate, crop, resize and flip in one warp. The rotation about the
+    // center of the input is composed with the mapping of the crop box onto
+    // the output, so the rotated image is never computed.
+    void warp(const Mat& input, Mat& output) {
+        // Same as cv::getRotationMatrix2D(), without allocating the result.
+        double angle = _augParams.angle * CV_PI / 180;
+        double alpha = cos(angle);
+        double beta = sin(angle);
+        double cx = input.cols / 2;
+        double cy = input.rows / 2;
+        double m[2][3] = {{alpha, beta, (1 - alpha) * cx - beta * cy},
+                          {-beta, alpha, beta * cx + (1 - alpha) * cy}};
+        const Rect& box = _augParams.cropBox;
+        double sx = (double) _innerSize.width / box.width;
+        double sy = (double) _innerSize.height / box.height;
+        for (int i = 0; i < 3; i++) {
+            m[0][i] *= sx;
+            m[1][i] *= sy;
+        }
+        // Align pixel centers the same way as cv::resize.
+        m[0][2] += (0.5 - box.x) * sx - 0.5;
+        m[1][2] += (0.5 - box.y) * sy - 0.5;
+        if (_augParams.flip) {
+            for (int i = 0; i < 3; i++) {
+                m[0][i] = -m[0][i];
+            }
+            m[0][2] += _innerSize.width - 1;
+        }
+        // Bilinear sampling skips pixels once the crop box is scaled down by
+        // 2 or more. Average the input down by a whole factor first, the way
+        // cv::resize() would have done on the rotated crop, and warp from that.
+        Mat source = input;
+        int factor = std::min(box.width / _innerSize.width,
+                              box.height / _innerSize.height);
+        if (factor >= 2) {
+            // Make room for the largest shrunk input up front, so that the
+            // slot does not grow whenever the factor happens to be smaller.
+            _workspace.reserve(ImageWorkspace::SHRUNK,
+                               (size_t) (input.rows / 2) * (input.cols / 2) *
+                               input.elemSize());
+            source = _workspace.get(ImageWorkspace::SHRUNK, input.rows / factor,
+                                    input.cols / factor, input.type());
+            cv::resize(input, source, source.size(), 0, 0, CV_INTER_AREA);
+            // Pixel x of the shrunk input is at (x + 0.5) * fx - 0.5 in the
+            // input.
+            double fx = (double) input.cols / source.cols;
+            double fy = (double) input.rows / source.rows;
+            for (int i = 0; i < 2; i++) {
+                m[i][2] += m[i][0] * (fx - 1) / 2 + m[i][1] * (fy - 1) / 2;
+                m[i][0] *= fx;
+                m[i][1] *= fy;
+            }
+        }
+        output = _workspace.get(ImageWorkspace::OUTPUT, _innerSize.height,
+                                _innerSize.width, input.type());
+        int inter = box.area() < _numPixels ? CV_INTER_CUBIC : CV_INTER_LINEAR;
+        cv::warpAffine(source, output, Mat(2, 3, CV_64FC1, m), _innerSize, inter,
+                       cv::BORDER_CONSTANT);
+    }
+
     void resize(const Mat& input, Mat& output, const Size2i& size) {
-        if (_innerSize == input.size()) {
+        if (size == input.size()) {
             output = input;
         } else {
-            int inter = input.size().area() < _numPixels ? CV_INTER_CUBIC : CV_INTER_AREA;
-            cv::resize(input, output, _innerSize, 0, 0, inter);
+            int inter = input.size().area() < size.area() ? CV_INTER_CUBIC : CV_INTER_AREA;
+            cv::resize(input, output, size, 0, 0, inter);
         }
     }
 
@@ -448,9 +942,13 @@ private:
         if (_params->_colorNoiseStd == 0.0) {
             return;
         }
-        Mat alphas(3, 1, CV_32FC1, pixelstd);
-        alphas = (CPCA * CSTD.mul(alphas));  // this is the random coloring pixel
-        auto pixel = alphas.reshape(3, 1).at<Scalar_<float>>(0, 0);
+        // This is the random coloring pixel, CPCA * (CSTD .* pixelstd)
+        cv::Scalar pixel;
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < 3; k++) {
+                pixel[c] += _CPCA[c][k] * CSTD.at<float>(k, 0) * pixelstd[k];
+            }
+        }
         inout = (inout + pixel) / (1.0 + _params->_colorNoiseStd);
     }
 
@@ -472,26 +970,86 @@ private:
         /****************************
         *  BRIGHTNESS & SATURATION  *
         *****************************/
-        Mat satmtx = cbs[1] * (cbs[2] * Mat::eye(3, 3, CV_32FC1) +
-                                (1 - cbs[2]) * Mat::ones(3, 1, CV_32FC1) * GSCL.t());
-        cv::transform(inout, inout, satmtx);
+        // cbs[1] * (cbs[2] * I + (1 - cbs[2]) * ones(3, 1) * GSCL.t())
+        float sat[3][3];
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < 3; k++) {
+                sat[c][k] = cbs[1] * ((c == k ? cbs[2] : 0) +
+                                      (1 - cbs[2]) * GSCL.at<float>(k, 0));
+            }
+        }
+        cv::transform(inout, inout, Mat(3, 3, CV_32FC1, sat));
 
         /*************
         *  CONTRAST  *
         **************/
-        Mat gray_mean;
-        cv::cvtColor(Mat(1, 1, CV_32FC3, cv::mean(inout)), gray_mean, CV_BGR2GRAY);
-        inout = cbs[0] * inout + (1 - cbs[0]) * gray_mean.at<Scalar_<float>>(0, 0);
+        cv::Scalar mean = cv::mean(inout);
+        float grayMean = 0;
+        for (int c = 0; c < 3; c++) {
+            grayMean += GSCL.at<float>(c, 0) * mean[c];
+        }
+        inout = cbs[0] * inout + (1 - cbs[0]) * grayMean;
     }
 
-    void split(Mat& img, char* buf, int bufSize) {
-        Size2i size = img.size();
+    /*
+    Applies cbsjitter() and lighting() and splits the image into planes in one
+    pass. Both distortions map every pixel through the same affine color map,
+    so they compose into a single one. The contrast needs the grayscale mean
+    after the saturation matrix has been applied, which is that matrix applied
+    to the mean of the undistorted image.
+    */
+    void distortAndSplit(const Mat& img, char* buf, int bufSize) {
+        checkBufSize(img, bufSize);
+        float m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+        if (_params->_contrastMin != _params->_contrastMax) {
+            const float* cbs = _augParams.cbs;
+            cv::Scalar mean = cv::mean(img);
+            float grayMean = 0;
+            for (int c = 0; c < 3; c++) {
+                float satMean = 0;
+                for (int k = 0; k < 3; k++) {
+                    m[c][k] = cbs[1] * ((c == k ? cbs[2] : 0) +
+                                        (1 - cbs[2]) * GSCL.at<float>(k, 0));
+                    satMean += m[c][k] * mean[k];
+                }
+                grayMean += GSCL.at<float>(c, 0) * satMean;
+            }
+            for (int c = 0; c < 3; c++) {
+                for (int k = 0; k < 3; k++) {
+                    m[c][k] *= cbs[0];
+                }
+                m[c][3] = (1 - cbs[0]) * grayMean;
+            }
+        }
+        if (_params->_colorNoiseStd != 0.0) {
+            float scale = 1.0 + _params->_colorNoiseStd;
+            for (int c = 0; c < 3; c++) {
+                float pixel = 0;
+                for (int k = 0; k < 3; k++) {
+                    pixel += _CPCA[c][k] * CSTD.at<float>(k, 0) *
+                             _augParams.colornoise[k];
+                    m[c][k] /= scale;
+                }
+                m[c][3] = (m[c][3] + pixel) / scale;
+            }
+        }
+        int area = img.size().area();
+        ColorTransform::run(img.data, img.rows, img.cols, img.step,
+                            m, (uint8_t*) buf, area);
+    }
+
+    void checkBufSize(const Mat& img, int bufSize) {
         if (img.channels() * img.total() > (uint) bufSize) {
             stringstream ss;
             ss << "Decode failed - buffer too small for image: " <<
                     bufSize <<  " < " << img.channels() * img.total();
             throw std::runtime_error(ss.str());
         }
+    }
+
+    void split(Mat& img, char* buf, int bufSize) {
+        Size2i size = img.size();
+        checkBufSize(img, bufSize);
         if (img.channels() == 1) {
             Mat gray(size, CV_8U, buf);
             img.copyTo(gray);
@@ -509,6 +1067,11 @@ private:
 
     void createRandomAugParams(const Size2i& size) {
         _params->getDistortionValues(_rng, size, &_augParams);
+        // The photometric distortions have only ever been applied to crops
+        // that are not scaled down. This has to be decided on the crop box
+        // in the full image, before it is mapped onto a reduced decode.
+        const Rect& box = _augParams.cropBox;
+        _distortCrop = (box.area() < _numPixels) || (box.size() == _innerSize);
     }
 
 private:
@@ -518,4 +1081,14 @@ private:
     cv::RNG                     _rng;
     int                         _numPixels;
     AugParams                   _augParams;
+    // Whether the photometric distortions apply to the current crop.
+    bool                        _distortCrop;
+    // Null unless decoded images are cached.
+    DecodeCache*                _decodeCache;
+    ImageWorkspace              _workspace;
+    // Size of the last image that cv::imdecode() decoded into the workspace.
+    Size2i                      _decodedSize;
+#if HAS_JPEGLIB
+    JpegDecoder                 _jpeg;
+#endif
 };
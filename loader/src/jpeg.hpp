@@ -0,0 +1,505 @@
+/*
+ Copyright 2016 Nervana Systems Inc.
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+// Partial decoding needs libjpeg-turbo.
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && \
+    (LIBJPEG_TURBO_VERSION_NUMBER >= 1005000)
+#define HAS_JPEG_CROP 1
+#endif
+
+/*
+
+Direct use of libjpeg for the decode paths that cv::imdecode does not offer.
+
+The header of an image can be read on its own, so that the size of the image
+is known before deciding how to decode it. The image can then be decoded at
+1/2, 1/4 or 1/8 of its size, which libjpeg does cheaply by dropping high
+frequency DCT coefficients instead of decoding everything and resizing. With
+libjpeg-turbo, just a region of the image can be decoded as well. Rows above
+the region are skipped without being transformed and rows below it are not
+looked at.
+
+libjpeg reports errors by calling a handler that must not return. Every entry
+point sets a jump target for the handler and returns false if it is used, so
+that callers can fall back to another decoder. Any function that contains a
+jump target must not hold objects with destructors.
+
+libjpeg allocates its working memory for every image and frees it when the
+image is done. The decoder takes over those allocations and serves them from
+blocks that are kept for the next image, so that decoding does not touch the
+heap once the blocks are large enough. That includes the coefficients of the
+whole image that progressive images need, which libjpeg keeps in virtual
+arrays. The decoder keeps them in memory, which libjpeg does anyway unless
+it is built to swap them out to temporary files.
+
+*/
+
+// Grow-only memory that is handed out in order and taken back all at once.
+class JpegPool {
+public:
+    JpegPool() : _block(0), _used(0) {
+    }
+
+    virtual ~JpegPool() {
+        for (auto block : _blocks) {
+            delete[] block._memory;
+        }
+    }
+
+    // Return 0 if out of memory.
+    void* alloc(size_t size) {
+        // Row lengths are rounded up the same way, since libjpeg-turbo
+        // lets its SIMD code run past the end of a row.
+        size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        while ((_block < _blocks.size()) &&
+               (_used + size > _blocks[_block]._size)) {
+            _block++;
+            _used = 0;
+        }
+        if (_block == _blocks.size()) {
+            size_t blockSize = std::max(size, (size_t) MIN_BLOCK_SIZE);
+            if (_blocks.empty() == false) {
+                blockSize = std::max(blockSize, 2 * _blocks.back()._size);
+            }
+            Block block;
+            block._memory = new (std::nothrow) char[blockSize + ALIGNMENT];
+            if (block._memory == 0) {
+                return 0;
+            }
+            block._start = (char*) (((uintptr_t) block._memory + ALIGNMENT - 1) &
+                                    ~(uintptr_t) (ALIGNMENT - 1));
+            block._size = blockSize;
+            _blocks.push_back(block);
+            _used = 0;
+        }
+        void* result = _blocks[_block]._start + _used;
+        _used += size;
+        return result;
+    }
+
+    void clear() {
+        _block = 0;
+        _used = 0;
+    }
+
+private:
+    static const size_t ALIGNMENT = 64;
+    static const size_t MIN_BLOCK_SIZE = 64 * 1024;
+
+    class Block {
+    public:
+        char*                   _memory;
+        char*                   _start;
+        size_t                  _size;
+    };
+
+private:
+    std::vector<Block>          _blocks;
+    // Block that allocations are currently taken from.
+    size_t                      _block;
+    // Bytes used in that block.
+    size_t                      _used;
+};
+
+class JpegDecoder {
+public:
+    JpegDecoder() {
+        _info.err = jpeg_std_error(&_error._pub);
+        _error._pub.error_exit = onError;
+        _error._pub.output_message = onMessage;
+        jpeg_create_decompress(&_info);
+        // Keep APP1 markers for orientation().
+        jpeg_save_markers(&_info, JPEG_APP0 + 1, 0xFFFF);
+        // Allocations that only last for one image come from _pool.
+        _info.client_data = this;
+        _mem = *_info.mem;
+        _info.mem->alloc_small = allocSmall;
+        _info.mem->alloc_large = allocLarge;
+        _info.mem->alloc_sarray = allocSarray;
+        _info.mem->alloc_barray = allocBarray;
+        _info.mem->free_pool = freePool;
+        _info.mem->request_virt_barray = requestVirtBarray;
+        _info.mem->realize_virt_arrays = realizeVirtArrays;
+        _info.mem->access_virt_barray = accessVirtBarray;
+        _blockArrays = 0;
+    }
+
+    virtual ~JpegDecoder() {
+        jpeg_destroy_decompress(&_info);
+    }
+
+    // Return false if the data does not start with a valid JPEG header.
+    bool readHeader(const char* data, int size) {
+        jpeg_abort_decompress(&_info);
+        if ((size < 2) || ((uint8_t) data[0] != 0xFF) ||
+            ((uint8_t) data[1] != 0xD8)) {
+            return false;
+        }
+        if (setjmp(_error._jump) != 0) {
+            jpeg_abort_decompress(&_info);
+            return false;
+        }
+        jpeg_mem_src(&_info, (unsigned char*) data, size);
+        return jpeg_read_header(&_info, TRUE) == JPEG_HEADER_OK;
+    }
+
+    // Size of the image whose header was read last.
+    int width() {
+        return _info.image_width;
+    }
+
+    int height() {
+        return _info.image_height;
+    }
+
+    // EXIF orientation of the image whose header was read last, from 1 to 8.
+    // Unless it is 1, the image is meant to be shown rotated or mirrored.
+    // This decoder always decodes in the orientation that the image is
+    // stored in, while cv::imdecode may apply the orientation.
+    int orientation() {
+        for (jpeg_saved_marker_ptr marker = _info.marker_list; marker != 0;
+             marker = marker->next) {
+            int result = exifOrientation(marker->data, marker->data_length);
+            if (result != 0) {
+                return result;
+            }
+        }
+        return 1;
+    }
+
+    // Prepare to decode at 1/scale of the full size, where scale is 1, 2, 4
+    // or 8. The size of the output is known after this.
+    bool start(int scale, int channelCount) {
+        if (setjmp(_error._jump) != 0) {
+            jpeg_abort_decompress(&_info);
+            return false;
+        }
+        _info.scale_num = 1;
+        _info.scale_denom = scale;
+        if (channelCount == 1) {
+            _info.out_color_space = JCS_GRAYSCALE;
+        } else {
+#ifdef JCS_EXTENSIONS
+            _info.out_color_space = JCS_EXT_BGR;
+#else
+            _info.out_color_space = JCS_RGB;
+#endif
+        }
+        jpeg_start_decompress(&_info);
+        return true;
+    }
+
+    int outputWidth() {
+        return _info.output_width;
+    }
+
+    int outputHeight() {
+        return _info.output_height;
+    }
+
+    // Decode every output row into dst, with rows dstStride bytes apart.
+    // Pixels are stored in BGR order, like cv::imdecode stores them.
+    bool read(uint8_t* dst, long dstStride) {
+        if (setjmp(_error._jump) != 0) {
+            jpeg_abort_decompress(&_info);
+            return false;
+        }
+        while (_info.output_scanline < _info.output_height) {
+            JSAMPROW row = dst + _info.output_scanline * dstStride;
+            jpeg_read_scanlines(&_info, &row, 1);
+#ifndef JCS_EXTENSIONS
+            if (_info.out_color_space == JCS_RGB) {
+                for (uint i = 0; i < _info.output_width; i++) {
+                    std::swap(row[3 * i], row[3 * i + 2]);
+                }
+            }
+#endif
+        }
+        jpeg_finish_decompress(&_info);
+        return true;
+    }
+
+    // Whether crop() and readRows() are supported.
+    static bool canCrop() {
+#if HAS_JPEG_CROP
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Limit decoding to the output columns x to x + width - 1, after start().
+    // libjpeg widens them to iMCU boundaries, so x and width are updated to
+    // the columns that will be decoded. Columns and rows are counted in the
+    // orientation the image is stored in, so this returns false for images
+    // that are shown in another orientation, as well as if libjpeg cannot
+    // decode regions.
+    bool crop(int& x, int& width) {
+#if HAS_JPEG_CROP
+        if (orientation() != 1) {
+            jpeg_abort_decompress(&_info);
+            return false;
+        }
+        if (setjmp(_error._jump) != 0) {
+            jpeg_abort_decompress(&_info);
+            return false;
+        }
+        JDIMENSION offset = x;
+        JDIMENSION columns = width;
+        jpeg_crop_scanline(&_info, &offset, &columns);
+        x = offset;
+        width = columns;
+        return true;
+#else
+        jpeg_abort_decompress(&_info);
+        return false;
+#endif
+    }
+
+    // Decode only the output rows y to y + height - 1 into dst, with rows
+    // dstStride bytes apart. Used after crop() instead of read().
+    bool readRows(int y, int height, uint8_t* dst, long dstStride) {
+#if HAS_JPEG_CROP
+        if (setjmp(_error._jump) != 0) {
+            jpeg_abort_decompress(&_info);
+            return false;
+        }
+        if (y > 0) {
+            jpeg_skip_scanlines(&_info, y);
+        }
+        for (int i = 0; i < height; i++) {
+            JSAMPROW row = dst + i * dstStride;
+            jpeg_read_scanlines(&_info, &row, 1);
+        }
+        // The remaining rows are not needed.
+        jpeg_abort_decompress(&_info);
+        return true;
+#else
+        jpeg_abort_decompress(&_info);
+        return false;
+#endif
+    }
+
+private:
+    // Return the orientation tag in the first IFD of an APP1 marker, or 0
+    // if the marker does not hold EXIF data. Damaged data counts as 1.
+    static int exifOrientation(const uint8_t* data, unsigned size) {
+        if ((size < 6) || (memcmp(data, "Exif\0\0", 6) != 0)) {
+            return 0;
+        }
+        // A TIFF header follows, which sets the byte order of everything
+        // after it and points to the first IFD.
+        const uint8_t* tiff = data + 6;
+        uint64_t tiffSize = size - 6;
+        if ((tiffSize < 8) || ((memcmp(tiff, "II", 2) != 0) &&
+                               (memcmp(tiff, "MM", 2) != 0))) {
+            return 1;
+        }
+        bool bigEndian = (tiff[0] == 'M');
+        auto read = [&](uint64_t offset, int bytes) {
+            uint32_t value = 0;
+            for (int i = 0; i < bytes; i++) {
+                int shift = bigEndian ? 8 * (bytes - 1 - i) : 8 * i;
+                value |= (uint32_t) tiff[offset + i] << shift;
+            }
+            return value;
+        };
+        uint64_t ifd = read(4, 4);
+        if (ifd + 2 > tiffSize) {
+            return 1;
+        }
+        // Entries of 12 bytes: tag, type, count and value.
+        uint32_t count = read(ifd, 2);
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t entry = ifd + 2 + 12 * i;
+            if (entry + 12 > tiffSize) {
+                break;
+            }
+            if (read(entry, 2) == 0x0112) {
+                uint32_t value = read(entry + 8, 2);
+                return ((value >= 1) && (value <= 8)) ? value : 1;
+            }
+        }
+        return 1;
+    }
+
+    class ErrorManager {
+    public:
+        jpeg_error_mgr          _pub;
+        jmp_buf                 _jump;
+    };
+
+    // Lives in _pool, like the rows it points to.
+    class BlockArray {
+    public:
+        JBLOCKARRAY             _rows;
+        JDIMENSION              _rowSize;
+        JDIMENSION              _rowCount;
+        bool                    _zero;
+        BlockArray*             _next;
+    };
+
+    static void onError(j_common_ptr info) {
+        longjmp(((ErrorManager*) info->err)->_jump, 1);
+    }
+
+    // Warnings about damaged data are of no use in the middle of training.
+    static void onMessage(j_common_ptr info) {
+    }
+
+    static void* alloc(j_common_ptr info, size_t size) {
+        void* result = ((JpegDecoder*) info->client_data)->_pool.alloc(size);
+        if (result == 0) {
+            info->err->msg_code = JERR_OUT_OF_MEMORY;
+            info->err->error_exit(info);
+        }
+        return result;
+    }
+
+    static void* allocSmall(j_common_ptr info, int poolId, size_t size) {
+        if (poolId != JPOOL_IMAGE) {
+            return ((JpegDecoder*) info->client_data)->_mem.alloc_small(
+                    info, poolId, size);
+        }
+        return alloc(info, size);
+    }
+
+    static void* allocLarge(j_common_ptr info, int poolId, size_t size) {
+        if (poolId != JPOOL_IMAGE) {
+            return ((JpegDecoder*) info->client_data)->_mem.alloc_large(
+                    info, poolId, size);
+        }
+        return alloc(info, size);
+    }
+
+    static JSAMPARRAY allocSarray(j_common_ptr info, int poolId,
+                                  JDIMENSION rowSize, JDIMENSION rowCount) {
+        if (poolId != JPOOL_IMAGE) {
+            return ((JpegDecoder*) info->client_data)->_mem.alloc_sarray(
+                    info, poolId, rowSize, rowCount);
+        }
+        JSAMPARRAY result = (JSAMPARRAY) alloc(info, rowCount * sizeof(JSAMPROW));
+        for (JDIMENSION i = 0; i < rowCount; i++) {
+            result[i] = (JSAMPROW) alloc(info, rowSize * sizeof(JSAMPLE));
+        }
+        return result;
+    }
+
+    static JBLOCKARRAY allocBarray(j_common_ptr info, int poolId,
+                                   JDIMENSION rowSize, JDIMENSION rowCount) {
+        if (poolId != JPOOL_IMAGE) {
+            return ((JpegDecoder*) info->client_data)->_mem.alloc_barray(
+                    info, poolId, rowSize, rowCount);
+        }
+        JBLOCKARRAY result = (JBLOCKARRAY) alloc(info, rowCount * sizeof(JBLOCKROW));
+        for (JDIMENSION i = 0; i < rowCount; i++) {
+            result[i] = (JBLOCKROW) alloc(info, rowSize * sizeof(JBLOCK));
+        }
+        return result;
+    }
+
+    // Virtual arrays that only last for one image are handed to libjpeg as
+    // pointers to BlockArray, which it passes back to accessVirtBarray().
+    static jvirt_barray_ptr requestVirtBarray(j_common_ptr info, int poolId,
+                                              boolean preZero,
+                                              JDIMENSION rowSize,
+                                              JDIMENSION rowCount,
+                                              JDIMENSION maxAccess) {
+        JpegDecoder* decoder = (JpegDecoder*) info->client_data;
+        if (poolId != JPOOL_IMAGE) {
+            return decoder->_mem.request_virt_barray(info, poolId, preZero,
+                                                     rowSize, rowCount,
+                                                     maxAccess);
+        }
+        BlockArray* array = (BlockArray*) alloc(info, sizeof(BlockArray));
+        array->_rows = 0;
+        array->_rowSize = rowSize;
+        array->_rowCount = rowCount;
+        array->_zero = (preZero == TRUE);
+        array->_next = decoder->_blockArrays;
+        decoder->_blockArrays = array;
+        return (jvirt_barray_ptr) array;
+    }
+
+    static void realizeVirtArrays(j_common_ptr info) {
+        JpegDecoder* decoder = (JpegDecoder*) info->client_data;
+        decoder->_mem.realize_virt_arrays(info);
+        for (BlockArray* array = decoder->_blockArrays; array != 0;
+             array = array->_next) {
+            if (array->_rows != 0) {
+                continue;
+            }
+            array->_rows = allocBarray(info, JPOOL_IMAGE, array->_rowSize,
+                                       array->_rowCount);
+            if (array->_zero == true) {
+                for (JDIMENSION i = 0; i < array->_rowCount; i++) {
+                    memset(array->_rows[i], 0, array->_rowSize * sizeof(JBLOCK));
+                }
+            }
+        }
+    }
+
+    static JBLOCKARRAY accessVirtBarray(j_common_ptr info, jvirt_barray_ptr ptr,
+                                        JDIMENSION startRow, JDIMENSION rowCount,
+                                        boolean writable) {
+        JpegDecoder* decoder = (JpegDecoder*) info->client_data;
+        for (BlockArray* array = decoder->_blockArrays; array != 0;
+             array = array->_next) {
+            if ((jvirt_barray_ptr) array != ptr) {
+                continue;
+            }
+            if ((array->_rows == 0) ||
+                (startRow + rowCount > array->_rowCount)) {
+                info->err->msg_code = JERR_BAD_VIRTUAL_ACCESS;
+                info->err->error_exit(info);
+            }
+            return array->_rows + startRow;
+        }
+        return decoder->_mem.access_virt_barray(info, ptr, startRow, rowCount,
+                                                writable);
+    }
+
+    static void freePool(j_common_ptr info, int poolId) {
+        JpegDecoder* decoder = (JpegDecoder*) info->client_data;
+        if (poolId == JPOOL_IMAGE) {
+            decoder->_pool.clear();
+            decoder->_blockArrays = 0;
+        }
+        decoder->_mem.free_pool(info, poolId);
+    }
+
+private:
+    jpeg_decompress_struct      _info;
+    ErrorManager                _error;
+    // The memory manager of libjpeg as it was before the methods above
+    // replaced some of its methods.
+    jpeg_memory_mgr             _mem;
+    JpegPool                    _pool;
+    // Virtual arrays of the current image, most recently requested first.
+    BlockArray*                 _blockArrays;
+};
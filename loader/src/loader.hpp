@@ -16,6 +16,8 @@
 #include <assert.h>
 
 #include <vector>
+#include <deque>
+#include <atomic>
 #include <cstdio>
 #include <iostream>
 #include <chrono>
@@ -24,11 +26,12 @@
 
 #include "archive.hpp"
 #include "media.hpp"
-#include "matrix.hpp"
+#include "transpose.hpp"
 #include "device.hpp"
 
 using std::tie;
 using std::ignore;
+using std::atomic;
 
 class DecodeThreadPool : public ThreadPool {
 public:
@@ -40,39 +43,60 @@ public:
                      Device* device,
                      MediaParams* mediaParams)
     : ThreadPool(count),
-      _itemsPerThread((batchSize - 1) / count + 1),
       _in(in), _out(out), _endSignaled(0),
-      _manager(0), _stopManager(false), _managerStopped(false), _inputBuf(0),
+      _manager(0), _publisher(0), _stopManager(false), _publishing(false),
+      _inputBuf(0), _outputBuf(0),
       _bufferIndex(0), _batchSize(batchSize),
       _datumSize(datumSize), _datumTypeSize(datumTypeSize),
       _targetSize(targetSize), _targetTypeSize(targetTypeSize),
       _targetConversion(targetConversion),
       _datumLen(datumSize * datumTypeSize),
       _targetLen(targetSize * targetTypeSize),
-      _device(device) {
-        assert(_itemsPerThread * count >= _batchSize);
-        assert(_itemsPerThread * (count - 1) < _batchSize);
+      _device(device), _direct(device->getDataPtr(0) != 0),
+      _chunkSize(1), _outputIndex(0), _reserveIndex(0),
+      _dataDst(0), _targetsDst(0), _metaDst(0) {
+        assert(count <= _batchSize);
+        _nextItem = 0;
+        // Consecutive items share cache lines in the transposed output.
+        // Hand out runs of consecutive items so that fewer lines bounce
+        // between cores, while still leaving a chunk for every thread.
+        int limit = std::min(CACHE_LINE_SIZE / _datumTypeSize,
+                             _batchSize / count);
+        while (_chunkSize * 2 <= limit) {
+            _chunkSize *= 2;
+        }
         _media = new Media*[count];
         for (int i = 0; i < count; i++) {
             _media[i] = Media::create(mediaParams, 0, i);
             _startSignaled.push_back(0);
-            _startInds.push_back(0);
-            _endInds.push_back(0);
-            _dataOffsets.push_back(0);
-            _targetOffsets.push_back(0);
-            _metaOffsets.push_back(0);
+            _datumScratch.push_back(new CharBuffer(_chunkSize * _datumLen));
+            _targetScratch.push_back(new CharBuffer(_chunkSize * _targetLen));
         }
     }
 
     virtual ~DecodeThreadPool() {
         if (_manager != 0) {
-            _manager->join();
+            if (_manager->joinable() == true) {
+                _manager->join();
+            }
             delete _manager;
         }
+        if (_publisher != 0) {
+            if (_publisher->joinable() == true) {
+                _publisher->join();
+            }
+            delete _publisher;
+        }
         for (int i = 0; i < _count; i++) {
             delete _media[i];
         }
         delete[] _media;
+        for (auto buf : _datumScratch) {
+            delete buf;
+        }
+        for (auto buf : _targetScratch) {
+            delete buf;
+        }
         // The other thread objects are freed in the destructor
         // of the parent class.
     }
@@ -82,46 +106,51 @@ public:
             _threads.push_back(new thread(&DecodeThreadPool::run, this, i));
         }
         _manager = new thread(&DecodeThreadPool::manage, this);
+        _publisher = new thread(&DecodeThreadPool::publish, this);
     }
 
     virtual void stop() {
+        // Wake up every thread and wait for all of them to exit. Taking
+        // each lock before notifying makes sure that no waiter misses the
+        // flags set above.
         ThreadPool::stop();
-        while (stopped() == false) {
-            std::this_thread::yield();
-            _in.advanceWritePos();
-            _in.signalNonEmpty();
-        }
-
         _stopManager = true;
-        while (_managerStopped == false) {
-            std::this_thread::yield();
-            _in.advanceWritePos();
-            _in.signalNonEmpty();
-            _endSignaled++;
-            _ended.notify_one();
+        {
+            lock_guard<mutex> lock(_mutex);
         }
-    }
-
-protected:
-    virtual void run(int id) {
-        assert(id < _count);
-        _startInds[id] = id * _itemsPerThread;
-        int itemCount = _itemsPerThread;
-        if (id == _count - 1) {
-            itemCount = _batchSize - id * _itemsPerThread;
+        _started.notify_all();
+        _ended.notify_all();
+        {
+            lock_guard<mutex> lock(_publishMutex);
         }
-
-        _endInds[id] = _startInds[id] + itemCount;
-        _dataOffsets[id] = _startInds[id] * _datumLen;
-        _targetOffsets[id] = _startInds[id] * _targetLen;
-        _metaOffsets[id] = _startInds[id];
-        while (_done == false) {
-            work(id);
+        _decodedReady.notify_all();
+        _in.abort();
+        _out.abort();
+        join();
+        if (_manager != 0) {
+            _manager->join();
         }
+        if (_publisher != 0) {
+            _publisher->join();
+        }
+    }
 
-        _stopped[id] = true;
+    void drain() {
+        // Called after pause() once the buffer pools have been aborted.
+        // Waits for the manager to finish the minibatch in hand and for the
+        // publisher to go idle, then drops whatever is still queued so that
+        // the next minibatch lands in the first buffer of the ring.
+        waitForPark(1);
+        unique_lock<mutex> lock(_publishMutex);
+        _decoded.clear();
+        while (_publishing == true) {
+            _publishDone.wait(lock);
+        }
+        _reserveIndex = 0;
+        _bufferIndex = 0;
     }
 
+protected:
     void transform(int id, char* encDatum, int encDatumLen,
                    char* encTarget, int encTargetLen,
                    char* datumBuf, char* targetBuf, int* meta) {
@@ -155,44 +184,23 @@ protected:
         // Thread function.
         {
             unique_lock<mutex> lock(_mutex);
-            while (_startSignaled[id] == 0) {
+            while ((_startSignaled[id] == 0) && (_done == false)) {
                 _started.wait(lock);
-                if (_done == true) {
-                    return;
-                }
+            }
+            if (_done == true) {
+                return;
             }
             _startSignaled[id]--;
             assert(_startSignaled[id] == 0);
         }
 
-        int start = _startInds[id];
-        int end = _endInds[id];
-        // No locking required because threads
-        // write into non-overlapping regions.
-        BufferTuple& dst = _out.getForWrite();
-        char* datumBuf = get<0>(dst)->_data + _dataOffsets[id];
-        char* targetBuf = get<1>(dst)->_data + _targetOffsets[id];
-        int* metaBuf = get<2>(dst)->_data + _metaOffsets[id];
-        CharBuffer* srcData;
-        CharBuffer* srcTargets;
-        tie(srcData, srcTargets, ignore) = *_inputBuf;
-
-        for (int i = start; i < end; i++) {
-            int encDatumLen = 0;
-            char* encDatum = srcData->getItem(i, encDatumLen);
-            assert(encDatum != 0);
-            int encTargetLen = 0;
-            char* encTarget = srcTargets->getItem(i, encTargetLen);
-            if (_targetConversion == READ_CONTENTS) {
-                transform(id, encDatum, encDatumLen, encTarget, encTargetLen,
-                          datumBuf, targetBuf, true);
-            } else {
-                transform(id, encDatum, encDatumLen, encTarget, encTargetLen,
-                          datumBuf, targetBuf, metaBuf);
-            }
-            datumBuf += _datumLen;
-            targetBuf += _targetLen;
-            metaBuf += 1;
+        // Items are handed out in chunks from a shared cursor so that
+        // threads which draw cheap items keep pulling work instead of idling
+        // behind a thread that drew a few large ones. No locking is required
+        // for the output because every item has a fixed slot in the batch.
+        int start;
+        while ((start = _nextItem.fetch_add(_chunkSize)) < _batchSize) {
+            decode(id, start, std::min(start + _chunkSize, _batchSize));
         }
 
         {
@@ -203,75 +211,156 @@ protected:
         _ended.notify_one();
     }
 
+    void decodeItem(int id, int i, char* datumBuf, char* targetBuf, int* metaBuf) {
+        CharBuffer* srcData;
+        CharBuffer* srcTargets;
+        tie(srcData, srcTargets, ignore) = *_inputBuf;
+        int encDatumLen = 0;
+        char* encDatum = srcData->getItem(i, encDatumLen);
+        assert(encDatum != 0);
+        int encTargetLen = 0;
+        char* encTarget = srcTargets->getItem(i, encTargetLen);
+        if (_targetConversion == READ_CONTENTS) {
+            transform(id, encDatum, encDatumLen, encTarget, encTargetLen,
+                      datumBuf, targetBuf, true);
+        } else {
+            transform(id, encDatum, encDatumLen, encTarget, encTargetLen,
+                      datumBuf, targetBuf, metaBuf);
+        }
+    }
+
+    void decode(int id, int start, int end) {
+        // Decode a chunk of items into per-thread scratch space and scatter
+        // them straight into their final positions in the output buffer.
+        char* datumScratch = _datumScratch[id]->_data;
+        char* targetScratch = _targetScratch[id]->_data;
+        for (int i = start; i < end; i++) {
+            decodeItem(id, i,
+                       datumScratch + (i - start) * _datumLen,
+                       targetScratch + (i - start) * _targetLen,
+                       _metaDst + i);
+        }
+        int count = end - start;
+        Transpose::run(datumScratch, count, _datumSize, _datumTypeSize,
+                       _dataDst + start * _datumTypeSize, _batchSize);
+        Transpose::run(targetScratch, count, _targetSize, _targetTypeSize,
+                       _targetsDst + start * _targetTypeSize, _batchSize);
+    }
+
     void produce() {
-        // Produce a minibatch.
+        // Decode a minibatch into the next free output buffer.
+        _outputBuf = _out.reserve();
+        if (_outputBuf == 0) {
+            return;
+        }
+        // Buffers are reserved and published in ring order, so the reserved
+        // buffer maps onto the device buffer with the same index.
+        _outputIndex = _reserveIndex;
+        _reserveIndex = (_reserveIndex + 1) % _device->_count;
+        // Decoded items go straight to the device buffer when it is host
+        // accessible. Otherwise they are staged and copied by the publisher.
+        if (_direct == true) {
+            _dataDst = _device->getDataPtr(_outputIndex);
+            _targetsDst = _device->getTargetsPtr(_outputIndex);
+            _metaDst = _device->getMetaPtr(_outputIndex);
+            if (_metaDst == 0) {
+                // The caller did not ask for metadata. Stage it anyway, the
+                // publisher does not copy it anywhere.
+                _metaDst = get<2>(*_outputBuf)->_data;
+            }
+        } else {
+            _dataDst = get<0>(*_outputBuf)->_data;
+            _targetsDst = get<1>(*_outputBuf)->_data;
+            _metaDst = get<2>(*_outputBuf)->_data;
+        }
         {
-            unique_lock<mutex> lock(_out.getMutex());
-            while (_out.full() == true) {
-                _out.waitForNonFull(lock);
+            lock_guard<mutex> lock(_mutex);
+            _nextItem = 0;
+            for (unsigned int i = 0; i < _startSignaled.size(); i++) {
+                _startSignaled[i] = 1;
             }
-            {
-                lock_guard<mutex> lock(_mutex);
-                for (unsigned int i = 0; i < _startSignaled.size(); i++) {
-                    _startSignaled[i] = 1;
-                }
+        }
+        _started.notify_all();
+        {
+            unique_lock<mutex> lock(_mutex);
+            while ((_endSignaled < _count) && (_stopManager == false)) {
+                _ended.wait(lock);
             }
-            _started.notify_all();
-            {
-                unique_lock<mutex> lock(_mutex);
-                while (_endSignaled < _count) {
-                    _ended.wait(lock);
-                }
-                _endSignaled = 0;
+            if (_stopManager == true) {
+                return;
             }
-            // At this point, we have decoded data for the whole minibatch.
-            CharBuffer* data;
-            CharBuffer* targets;
-            IntBuffer* meta;
-            tie(data, targets, meta) = _out.getForWrite();
-            Matrix::transpose(data, _batchSize, _datumSize, _datumTypeSize);
-            Matrix::transpose(targets, _batchSize, _targetSize, _targetTypeSize);
-            // Copy to device.
-            _device->copyData(_bufferIndex, data);
-            _device->copyLabels(_bufferIndex, targets);
-            _device->copyMeta(_bufferIndex, meta);
-            _bufferIndex = (_bufferIndex == 0) ? 1 : 0;
-            _out.advanceWritePos();
-        }
-        _out.signalNonEmpty();
+            _endSignaled = 0;
+        }
+        // At this point, we have decoded data for the whole minibatch.
+        // Hand it over to the publisher so that the decode threads can move
+        // on to the next input buffer while this one is copied.
+        {
+            lock_guard<mutex> lock(_publishMutex);
+            _decoded.push_back(_outputBuf);
+        }
+        _decodedReady.notify_one();
     }
 
     void consume() {
         // Consume an input buffer.
-        {
-            unique_lock<mutex> lock(_in.getMutex());
-            while (_in.empty() == true) {
-                _in.waitForNonEmpty(lock);
-                if (_stopManager == true) {
-                    return;
-                }
-            }
-            _inputBuf = &_in.getForRead();
-            produce();
-            _in.advanceReadPos();
+        _inputBuf = _in.acquire();
+        if (_inputBuf == 0) {
+            return;
         }
-        _in.signalNonFull();
+        produce();
+        _in.release();
     }
 
     void manage() {
         // Thread function.
+        while (_stopManager == false) {
+            consume();
+            park();
+        }
+    }
+
+    void publish() {
+        // Thread function.
+        // Minibatches are published in the order that they were decoded.
         int result = _device->init();
         if (result != 0) {
             _stopManager = true;
         }
         while (_stopManager == false) {
-            consume();
+            BufferTuple* buf;
+            {
+                unique_lock<mutex> lock(_publishMutex);
+                while ((_decoded.empty() == true) && (_stopManager == false)) {
+                    _decodedReady.wait(lock);
+                }
+                if (_stopManager == true) {
+                    return;
+                }
+                buf = _decoded.front();
+                _decoded.pop_front();
+                _publishing = true;
+            }
+            if (_direct == false) {
+                CharBuffer* data;
+                CharBuffer* targets;
+                IntBuffer* meta;
+                tie(data, targets, meta) = *buf;
+                // Copy to device.
+                _device->copyData(_bufferIndex, data);
+                _device->copyLabels(_bufferIndex, targets);
+                _device->copyMeta(_bufferIndex, meta);
+            }
+            _bufferIndex = (_bufferIndex + 1) % _device->_count;
+            _out.publish();
+            {
+                lock_guard<mutex> lock(_publishMutex);
+                _publishing = false;
+            }
+            _publishDone.notify_all();
         }
-        _managerStopped = true;
     }
 
 private:
-    int                         _itemsPerThread;
     BufferPool&                 _in;
     BufferPool&                 _out;
     mutex                       _mutex;
@@ -280,16 +369,22 @@ private:
     vector<int>                 _startSignaled;
     int                         _endSignaled;
     thread*                     _manager;
-    bool                        _stopManager;
-    bool                        _managerStopped;
+    // Copies decoded minibatches to the device.
+    thread*                     _publisher;
+    atomic<bool>                _stopManager;
+    // Whether the publisher is working on a minibatch outside the lock.
+    bool                        _publishing;
+    // Decoded minibatches waiting to be published.
+    std::deque<BufferTuple*>    _decoded;
+    mutex                       _publishMutex;
+    condition_variable          _decodedReady;
+    condition_variable          _publishDone;
     BufferTuple*                _inputBuf;
+    BufferTuple*                _outputBuf;
     int                         _bufferIndex;
     int                         _batchSize;
-    vector<int>                 _startInds;
-    vector<int>                 _endInds;
-    vector<int>                 _dataOffsets;
-    vector<int>                 _targetOffsets;
-    vector<int>                 _metaOffsets;
+    // Index of the next item in the minibatch to be decoded.
+    atomic<int>                 _nextItem;
     int                         _datumSize;
     int                         _datumTypeSize;
     int                         _targetSize;
@@ -300,42 +395,109 @@ private:
     // Target length in bytes.
     int                         _targetLen;
     Device*                     _device;
+    // Whether decoded items are written straight into the device buffers.
+    bool                        _direct;
+    // Number of consecutive items handed to a thread at a time.
+    int                         _chunkSize;
+    // Index of the device buffer that the current minibatch goes to.
+    int                         _outputIndex;
+    int                         _reserveIndex;
+    vector<CharBuffer*>         _datumScratch;
+    vector<CharBuffer*>         _targetScratch;
+    // Where the workers scatter the current minibatch.
+    char*                       _dataDst;
+    char*                       _targetsDst;
+    int*                        _metaDst;
     Media**                     _media;
 };
 
 class ReadThread: public ThreadPool {
 public:
-    ReadThread(BufferPool& out, Reader* reader)
-    : ThreadPool(1), _out(out), _reader(reader) {
-        assert(_count == 1);
+    ReadThread(BufferPool& out, ArchiveReader* reader, int count)
+    : ThreadPool(count), _out(out), _reader(reader), _claims(count) {
     }
 
 protected:
     virtual void work(int id) {
-        produce();
+        produce(id);
+        park();
     }
 
-    void produce() {
-        // Fill input buffers.
+    void produce(int id) {
+        // Fill input buffers. A slot is reserved and the reader claims the
+        // items that go into it under one lock, so minibatches come out in
+        // reading order however many threads there are. The items are read
+        // outside of the lock, in parallel with the other threads, and the
+        // pool publishes the slots in the order that they were reserved.
+        BufferTuple* bufs;
+        vector<ItemRef>& items = _claims[id];
         {
-            unique_lock<mutex> lock(_out.getMutex());
-            while (_out.full() == true) {
-                _out.waitForNonFull(lock);
+            lock_guard<mutex> lock(_readMutex);
+            bufs = _out.reserve();
+            if (bufs == 0) {
+                return;
             }
-            BufferTuple& bufs = _out.getForWrite();
-            int result = _reader->read(bufs);
+            int result = _reader->claim(items);
             if (result == -1) {
                 _done = true;
                 throw std::runtime_error("Could not read data\n");
             }
-            _out.advanceWritePos();
+            lock_guard<mutex> epochLock(_epochMutex);
+            _epochEnds.push_back(result == 1);
         }
-        _out.signalNonEmpty();
+        ArchiveReader::fill(items, *bufs);
+        // Let go of the archives as soon as the buffers refer to them.
+        items.clear();
+        load(get<0>(*bufs));
+        load(get<1>(*bufs));
+        _out.publish(bufs);
+    }
+
+    void load(CharBuffer* buf) {
+        // Touch every page of every item so that the decode threads do not
+        // stall on page faults.
+        static const int pageSize = sysconf(_SC_PAGESIZE);
+        volatile char sink;
+        for (int i = 0; i < buf->getItemCount(); i++) {
+            int len;
+            char* item = buf->getItem(i, len);
+            for (int j = 0; j < len; j += pageSize) {
+                sink = item[j];
+            }
+            if (len > 0) {
+                sink = item[len - 1];
+            }
+        }
+        (void) sink;
+    }
+
+public:
+    // Minibatches come out of the pipeline in the order that they were
+    // read, so the flags line up with the consumer's calls to this.
+    bool popEpochEnd() {
+        lock_guard<mutex> lock(_epochMutex);
+        if (_epochEnds.empty() == true) {
+            return false;
+        }
+        bool result = _epochEnds.front();
+        _epochEnds.pop_front();
+        return result;
+    }
+
+    void clearEpochEnds() {
+        lock_guard<mutex> lock(_epochMutex);
+        _epochEnds.clear();
     }
 
 private:
     BufferPool&                 _out;
-    Reader*                     _reader;
+    ArchiveReader*              _reader;
+    mutex                       _readMutex;
+    // Items claimed by each thread for the minibatch that it is reading.
+    vector<vector<ItemRef>>     _claims;
+    // Whether each minibatch in flight is the last one of an epoch.
+    std::deque<bool>            _epochEnds;
+    mutex                       _epochMutex;
 };
 
 class Loader {
@@ -348,22 +510,44 @@ public:
            int datumSize, int datumTypeSize,
            int targetSize, int targetTypeSize,
            int targetConversion, int subsetPercent,
+           int prefetchDepth, int readaheadMB, int readThreadCount,
+           int ingestAhead, int cacheMB,
            MediaParams* mediaParams,
            DeviceParams* deviceParams,
            MediaParams* ingestParams,
            char* alphabet)
-    : _first(true),
+    : _holding(false), _acquireIndex(0),
       _batchSize(batchSize),
       _datumSize(datumSize), _datumTypeSize(datumTypeSize),
       _targetSize(targetSize), _targetTypeSize(targetTypeSize),
       _targetConversion(targetConversion),
+      _prefetchDepth(prefetchDepth), _readThreadCount(readThreadCount),
       _readBufs(0), _decodeBufs(0), _readThread(0), _decodeThreads(0),
       _device(0), _reader(0), _mediaParams(mediaParams) {
+        if (_prefetchDepth < 1) {
+            throw std::runtime_error("Prefetch depth must be at least 1");
+        }
+        if (_readThreadCount < 1) {
+            throw std::runtime_error("Read thread count must be at least 1");
+        }
+        if (ingestAhead < 0) {
+            throw std::runtime_error("Ingest window must not be negative");
+        }
+        if (cacheMB < 0) {
+            throw std::runtime_error("Cache size must not be negative");
+        }
+        if (deviceParams->_count != _prefetchDepth) {
+            stringstream ss;
+            ss << "Device buffer count " << deviceParams->_count <<
+                  " does not match prefetch depth " << _prefetchDepth;
+            throw std::runtime_error(ss.str());
+        }
         _device = Device::create(deviceParams);
         _reader = new ArchiveReader(itemCount, batchSize, repoDir, archiveDir,
                                     indexFile, archivePrefix,
                                     shuffle, reshuffle,
-                                    startFileIdx, subsetPercent,
+                                    startFileIdx, subsetPercent, readaheadMB,
+                                    ingestAhead, cacheMB,
                                     mediaParams, ingestParams,
                                     targetTypeSize, targetConversion,
                                     alphabet);
@@ -379,21 +563,24 @@ public:
     }
 
     int start() {
-        _first = true;
+        _holding = false;
         try {
             int dataLen = _batchSize * _datumSize * _datumTypeSize;
             int targetLen = _batchSize * _targetSize * _targetTypeSize;
             int metaLen = 2 * _batchSize;
             // Start the read buffers off with a reasonable size. They will
             // get resized as needed.
-            _readBufs = new BufferPool(dataLen / 8, targetLen, metaLen);
-            _readThread = new ReadThread(*_readBufs, _reader);
+            _readBufs = new BufferPool(dataLen / 8, targetLen, metaLen,
+                                       false, _prefetchDepth);
+            _readThread = new ReadThread(*_readBufs, _reader, _readThreadCount);
             bool pinned = (_device->_type != CPU);
-            _decodeBufs = new BufferPool(dataLen, targetLen, metaLen, pinned);
+            // Each decode buffer maps onto the device buffer of the same
+            // index, so both rings must have the same depth.
+            _decodeBufs = new BufferPool(dataLen, targetLen, metaLen, pinned,
+                                         _prefetchDepth);
+            _acquireIndex = 0;
             int numCores = thread::hardware_concurrency();
-            int itemsPerThread = (_batchSize - 1) /  numCores + 1;
-            int threadCount =  (_batchSize - 1) / itemsPerThread + 1;
-            threadCount = std::min(threadCount, _batchSize);
+            int threadCount = std::max(1, std::min(numCores, _batchSize));
             _decodeThreads = new DecodeThreadPool(threadCount, _batchSize,
                     _datumSize, _datumTypeSize,
                     _targetSize, _targetTypeSize, _targetConversion,
@@ -407,15 +594,11 @@ public:
     }
 
     void stop() {
+        // Wake up any thread that is blocked on a buffer and wait for all
+        // of them to exit.
         _readThread->stop();
-        while (_readThread->stopped() == false) {
-            std::this_thread::yield();
-            drain();
-        }
-        while ((_decodeBufs->empty() == false) ||
-               (_readBufs->empty() == false)) {
-            drain();
-        }
+        _readBufs->abort();
+        _readThread->join();
         _decodeThreads->stop();
 
         delete _readBufs;
@@ -429,42 +612,69 @@ public:
     }
 
     int reset() {
-        stop();
+        // Start the next epoch without tearing down the pipeline. Every
+        // thread is held at a point where it owns no buffers, prefetched
+        // minibatches are dropped and the reader rewinds. The threads,
+        // media objects and buffers all stay resident.
+        _readThread->pause();
+        _decodeThreads->pause();
+        _readBufs->abort();
+        _decodeBufs->abort();
+        _readThread->waitForPark(_readThreadCount);
+        _decodeThreads->drain();
+        _readBufs->reset();
+        _decodeBufs->reset();
+        _readThread->clearEpochEnds();
         _reader->reset();
-        start();
+        _holding = false;
+        _acquireIndex = 0;
+        _decodeThreads->resume();
+        _readThread->resume();
         return 0;
     }
 
-    void next(Buffer<char>* dataBuf, Buffer<char>* targetsBuf) {
+    int next(Buffer<char>* dataBuf, Buffer<char>* targetsBuf) {
         // Copy minibatch data into the buffers passed in.
         // Only used for testing purposes.
-        {
-            unique_lock<mutex> lock(_decodeBufs->getMutex());
-            while (_decodeBufs->empty()) {
-                _decodeBufs->waitForNonEmpty(lock);
-            }
+        BufferTuple* bufs = _decodeBufs->acquire();
+        if (bufs == 0) {
+            return 0;
+        }
+        // Minibatches are acquired in ring order, like the device buffers
+        // that they were published to.
+        int index = _acquireIndex;
+        _acquireIndex = (_acquireIndex + 1) % _device->_count;
+        if (_device->getDataPtr(index) != 0) {
+            // Decoded straight into the device buffer. The staging buffers
+            // were not written to.
+            memcpy(dataBuf->_data, _device->getDataPtr(index), dataBuf->_size);
+            memcpy(targetsBuf->_data, _device->getTargetsPtr(index),
+                   targetsBuf->_size);
+        } else {
             Buffer<char>* data;
             Buffer<char>* targets;
-            tie(data, targets, ignore) = _decodeBufs->getForRead();
+            tie(data, targets, ignore) = *bufs;
             memcpy(dataBuf->_data, data->_data, dataBuf->_size);
             memcpy(targetsBuf->_data, targets->_data, targetsBuf->_size);
-            _decodeBufs->advanceReadPos();
         }
-        _decodeBufs->signalNonFull();
+        _decodeBufs->release();
+        return (_readThread->popEpochEnd() == true) ? 1 : 0;
     }
 
-    void next() {
-        unique_lock<mutex> lock(_decodeBufs->getMutex());
-        if (_first == true) {
-            _first = false;
-        } else {
+    int next() {
+        // Returns 1 if this is the last minibatch of an epoch. The pipeline
+        // keeps going into the next epoch, so there is no need to reset.
+        if (_holding == true) {
             // Unlock the buffer used for the previous minibatch.
-            _decodeBufs->advanceReadPos();
-            _decodeBufs->signalNonFull();
+            _holding = false;
+            _decodeBufs->release();
         }
-        while (_decodeBufs->empty()) {
-            _decodeBufs->waitForNonEmpty(lock);
+        if (_decodeBufs->acquire() == 0) {
+            // Aborted by reset() or stop(). There is nothing to release.
+            return 0;
         }
+        _holding = true;
+        return (_readThread->popEpochEnd() == true) ? 1 : 0;
     }
 
     Reader* getReader() {
@@ -476,31 +686,24 @@ public:
     }
 
 private:
-    void drain() {
-        {
-            unique_lock<mutex> lock(_decodeBufs->getMutex());
-            if (_decodeBufs->empty() == true) {
-                return;
-            }
-            _decodeBufs->advanceReadPos();
-        }
-        _decodeBufs->signalNonFull();
-    }
-
-
-private:
-    bool                        _first;
+    // Whether the consumer holds the buffer of the previous minibatch.
+    bool                        _holding;
+    // Index of the device buffer of the next minibatch to be acquired.
+    int                         _acquireIndex;
     int                         _batchSize;
     int                         _datumSize;
     int                         _datumTypeSize;
     int                         _targetSize;
     int                         _targetTypeSize;
     int                         _targetConversion;
+    // Number of minibatches buffered at each stage of the pipeline.
+    int                         _prefetchDepth;
+    int                         _readThreadCount;
     BufferPool*                 _readBufs;
     BufferPool*                 _decodeBufs;
     ReadThread*                 _readThread;
     DecodeThreadPool*           _decodeThreads;
     Device*                     _device;
-    Reader*                     _reader;
+    ArchiveReader*              _reader;
     MediaParams*                _mediaParams;
 };
@@ -0,0 +1,191 @@
+/*
+ Copyright 2016 Nervana Systems Inc.
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#pragma once
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "streams.hpp"
+
+#define MANIFEST_NAME       "manifest.bin"
+#define MANIFEST_MAGIC      "NMAN"
+#define MANIFEST_VERSION    1
+
+using std::string;
+using std::vector;
+
+class ArchiveInfo {
+public:
+    uint                        _itemCount;
+    uint                        _maxDatumSize;
+    uint                        _maxTargetSize;
+    uint                        _unused;
+    // Size of the archive file in bytes.
+    uint64_t                    _size;
+};
+
+/*
+
+Summary of an ingested dataset, written next to its archives once every
+archive is in place. It lets the loader start without parsing the index or
+opening the archives.
+
+The file consists of a ManifestHeader, an ArchiveInfo for every archive and
+the ingest signature of the media that produced the archives.
+
+*/
+
+class ManifestHeader {
+public:
+    ManifestHeader() {
+        memset(this, 0, sizeof(*this));
+        memcpy(_magic, MANIFEST_MAGIC, sizeof(_magic));
+        _version = MANIFEST_VERSION;
+    }
+
+public:
+    char                        _magic[4];
+    uint                        _version;
+    uint                        _itemCount;
+    // Number of items per archive. Only the last archive may hold fewer.
+    uint                        _archiveItemCount;
+    uint                        _archiveCount;
+    uint                        _maxDatumSize;
+    uint                        _maxTargetSize;
+    int                         _targetTypeSize;
+    int                         _targetConversion;
+    int                         _shuffle;
+    uint                        _signatureSize;
+    uint                        _unused;
+    // Modification time and size of the index file at ingest time.
+    int64_t                     _indexTime;
+    int64_t                     _indexSize;
+    uint64_t                    _indexHash;
+};
+
+class Manifest {
+public:
+    // Return false if the file does not exist or is not a valid manifest.
+    bool read(const string& fileName) {
+        FILE* file = fopen(fileName.c_str(), "rb");
+        if (file == 0) {
+            return false;
+        }
+        bool result = false;
+        struct stat stats;
+        if ((fstat(fileno(file), &stats) == 0) &&
+            (fread(&_header, sizeof(_header), 1, file) == 1) &&
+            (memcmp(_header._magic, MANIFEST_MAGIC, 4) == 0) &&
+            (_header._version == MANIFEST_VERSION) &&
+            // Do not trust the counts beyond what the file can hold.
+            ((uint64_t) _header._archiveCount * sizeof(ArchiveInfo) +
+             _header._signatureSize <=
+             (uint64_t) stats.st_size - sizeof(_header))) {
+            _archives.resize(_header._archiveCount);
+            _signature.resize(_header._signatureSize);
+            result = (fread(_archives.data(), sizeof(ArchiveInfo),
+                            _archives.size(), file) == _archives.size()) &&
+                     (fread(&_signature[0], 1, _signature.size(), file) ==
+                      _signature.size());
+        }
+        fclose(file);
+        return result;
+    }
+
+    // The manifest is only a shortcut, so failing to write it is not an
+    // error. It is written under a temporary name and then renamed, so that
+    // readers never see a partial manifest.
+    void write(const string& fileName) {
+        string tempName = fileName + ".tmp";
+        FILE* file = fopen(tempName.c_str(), "wb");
+        if (file == 0) {
+            return;
+        }
+        _header._archiveCount = _archives.size();
+        _header._signatureSize = _signature.size();
+        bool result = (fwrite(&_header, sizeof(_header), 1, file) == 1) &&
+                      (fwrite(_archives.data(), sizeof(ArchiveInfo),
+                              _archives.size(), file) == _archives.size()) &&
+                      (fwrite(_signature.data(), 1, _signature.size(), file) ==
+                       _signature.size());
+        result = (fclose(file) == 0) && result;
+        if ((result == false) ||
+            (rename(tempName.c_str(), fileName.c_str()) != 0)) {
+            unlink(tempName.c_str());
+        }
+    }
+
+    // Record the state of the index file that the archives were built from.
+    void setIndex(const string& indexFile) {
+        struct stat stats;
+        if (stat(indexFile.c_str(), &stats) != 0) {
+            return;
+        }
+        _header._indexTime = stats.st_mtime;
+        _header._indexSize = stats.st_size;
+        _header._indexHash = hash(indexFile);
+    }
+
+    // Check whether the archives are still up to date with the index file.
+    // A missing index is fine, the archives are all that is needed then.
+    // A changed modification time is fine too as long as the contents are
+    // the same.
+    bool matchesIndex(const string& indexFile) {
+        struct stat stats;
+        if (stat(indexFile.c_str(), &stats) != 0) {
+            return true;
+        }
+        if (stats.st_size != _header._indexSize) {
+            return false;
+        }
+        if (stats.st_mtime == _header._indexTime) {
+            return true;
+        }
+        return hash(indexFile) == _header._indexHash;
+    }
+
+    void addArchive(const ArchiveInfo& info) {
+        _archives.push_back(info);
+        _header._maxDatumSize = std::max(_header._maxDatumSize,
+                                         info._maxDatumSize);
+        _header._maxTargetSize = std::max(_header._maxTargetSize,
+                                          info._maxTargetSize);
+    }
+
+private:
+    // 64 bit FNV-1a hash of a file.
+    static uint64_t hash(const string& fileName) {
+        MappedFile file(fileName);
+        const unsigned char* data = (const unsigned char*) file.data();
+        uint64_t result = 14695981039346656037ULL;
+        for (size_t i = 0; i < file.size(); i++) {
+            result = (result ^ data[i]) * 1099511628211ULL;
+        }
+        return result;
+    }
+
+public:
+    ManifestHeader              _header;
+    vector<ArchiveInfo>         _archives;
+    // Describes the ingest settings of the media.
+    string                      _signature;
+};
@@ -19,8 +19,13 @@
 #pragma once
 
 #include <vector>
+#include <string>
 
 using std::vector;
+using std::string;
+
+#define UNSUPPORTED_MEDIA_MESSAGE "support not built-in. Please install the " \
+                                  "pre-requisites and re-run the installer."
 
 enum MediaType {
     UNKNOWN     = -1,
@@ -84,6 +89,12 @@ public:
         throw std::logic_error("Not implemented");
     }
 
+    // Describe the settings that ingest() depends on. Archives built with a
+    // different signature are not reused as is.
+    virtual string ingestSignature() {
+        return "";
+    }
+
     static Media* create(MediaParams* params, MediaParams* ingestParams, int id);
 };
 
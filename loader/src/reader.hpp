@@ -28,6 +28,7 @@
 #include <memory>
 #include <deque>
 #include <random>
+#include <algorithm>
 
 #include "buffer.hpp"
 
@@ -47,48 +48,68 @@ enum ConversionType {
 
 static_assert(sizeof(int) == 4, "Unsupported platform");
 
+// Location of one line of an index within the string arena of its Index.
+// The file name starts at _offset and the target follows right after it.
+// Both are null terminated.
 class IndexElement {
 public:
-    IndexElement() {
-    }
-
-public:
-    string                      _fileName;
-    vector<string>              _targets;
+    size_t                      _offset;
+    uint                        _fileNameSize;
+    uint                        _targetSize;
 };
 
+// The parsed contents of an index file. Each line after the header holds a
+// file name, optionally followed by a comma and a target. Lines that start
+// with '#' are comments.
+//
+// The file is mapped and parsed in a single pass. File names and targets
+// are copied into one contiguous arena, so that an index of millions of
+// lines costs two allocations rather than several per line. Readers of the
+// same index file share one parsed copy through get().
 class Index {
 public:
     Index() : _maxTargetSize(0) {
     }
 
-    virtual ~Index() {
-        for (auto elem : _elements) {
-            delete elem;
+    // Return the parsed contents of fileName. The file is only parsed again
+    // if nobody holds on to the result of an earlier call.
+    static shared_ptr<Index> get(const string& fileName) {
+        static mutex                            cacheMutex;
+        static map<string, std::weak_ptr<Index>> cache;
+        lock_guard<mutex> lock(cacheMutex);
+        shared_ptr<Index> index = cache[fileName].lock();
+        if (index == nullptr) {
+            index = std::make_shared<Index>();
+            index->load(fileName);
+            cache[fileName] = index;
         }
+        return index;
     }
 
-    void load(string& fileName, bool shuf = false) {
-        ifstream ifs(fileName);
-        if (!ifs) {
-            stringstream ss;
-            ss << "Could not open " << fileName;
-            throw std::ios_base::failure(ss.str());
-        }
-
-        string line;
+    void load(const string& fileName) {
+        MappedFile file(fileName);
+        const char* pos = file.data();
+        const char* end = pos + file.size();
+        _arena.clear();
+        _elements.clear();
+        // The arena never needs more room than the file itself.
+        _arena.reserve(file.size() + 1);
         // Ignore the header line.
-        std::getline(ifs, line);
-        while (std::getline(ifs, line)) {
-            if (line[0] == '#') {
-                // Ignore comments.
-                continue;
+        pos = nextLine(pos, end);
+        while (pos < end) {
+            const char* next = nextLine(pos, end);
+            const char* lineEnd = next;
+            if ((lineEnd > pos) && (lineEnd[-1] == '\n')) {
+                lineEnd--;
             }
-            addElement(line);
-        }
-
-        if (shuf == true) {
-            shuffle();
+            if ((lineEnd > pos) && (lineEnd[-1] == '\r')) {
+                lineEnd--;
+            }
+            if ((lineEnd > pos) && (*pos != '#')) {
+                // Ignore blank lines and comments.
+                addElement(pos, lineEnd);
+            }
+            pos = next;
         }
 
         if (_elements.size() == 0) {
@@ -98,43 +119,71 @@ public:
         }
     }
 
-    IndexElement* operator[] (int idx) {
-        return _elements[idx];
-    }
-
     uint size() {
         return _elements.size();
     }
 
-private:
-    void addElement(string& line) {
-        IndexElement* elem = new IndexElement();
-        std::istringstream ss(line);
-        string token;
-        std::getline(ss, token, ',');
-        elem->_fileName = token;
-        while (std::getline(ss, token, ',')) {
-            elem->_targets.push_back(token);
-        }
+    const char* fileName(int idx) {
+        return &_arena[_elements[idx]._offset];
+    }
 
-        // For now, restrict to a single target.
-        assert(elem->_targets.size() <= 1);
-        _elements.push_back(elem);
-        if (elem->_targets.size() == 0) {
-            return;
+    uint fileNameSize(int idx) {
+        return _elements[idx]._fileNameSize;
+    }
+
+    const char* target(int idx) {
+        IndexElement& elem = _elements[idx];
+        return &_arena[elem._offset + elem._fileNameSize + 1];
+    }
+
+    uint targetSize(int idx) {
+        return _elements[idx]._targetSize;
+    }
+
+    // Fill order with a fixed permutation of the lines.
+    void shuffle(vector<int>& order) {
+        order.resize(_elements.size());
+        for (uint i = 0; i < order.size(); i++) {
+            order[i] = i;
         }
-        if (elem->_targets[0].size() > _maxTargetSize) {
-            _maxTargetSize = elem->_targets[0].size();
+        std::srand(0);
+        std::random_shuffle(order.begin(), order.end());
+    }
+
+private:
+    static const char* nextLine(const char* pos, const char* end) {
+        if (pos >= end) {
+            return end;
         }
+        const char* newline = (const char*) memchr(pos, '\n', end - pos);
+        return (newline == 0) ? end : newline + 1;
     }
 
-    void shuffle() {
-        std::srand(0);
-        std::random_shuffle(_elements.begin(), _elements.end());
+    void addElement(const char* pos, const char* end) {
+        IndexElement elem;
+        const char* comma = (const char*) memchr(pos, ',', end - pos);
+        const char* nameEnd = (comma == 0) ? end : comma;
+        elem._offset = _arena.size();
+        elem._fileNameSize = nameEnd - pos;
+        _arena.insert(_arena.end(), pos, nameEnd);
+        _arena.push_back(0);
+        elem._targetSize = 0;
+        if (comma != 0) {
+            const char* target = comma + 1;
+            // For now, restrict to a single target.
+            assert(memchr(target, ',', end - target) == 0);
+            elem._targetSize = end - target;
+            _arena.insert(_arena.end(), target, end);
+        }
+        _arena.push_back(0);
+        _elements.push_back(elem);
+        _maxTargetSize = std::max(_maxTargetSize, elem._targetSize);
     }
 
 public:
-    vector<IndexElement*>       _elements;
+    vector<IndexElement>        _elements;
+    // File names and targets of all lines, back to back.
+    vector<char>                _arena;
     uint                        _maxTargetSize;
 };
 
@@ -149,6 +198,8 @@ public:
     }
 
     virtual ~Reader() {};
+    // Read a minibatch. Returns -1 on failure and 1 if the minibatch is the
+    // last one of an epoch.
     virtual int read(BufferTuple& buffers) = 0;
     virtual int reset() = 0;
 
@@ -189,7 +240,6 @@ public:
             // For now, assume that binary targets are 4 bytes long.
             assert(_targetTypeSize == 4);
         }
-        _ifs.exceptions(_ifs.failbit);
         loadIndex();
         *itemCount = _itemCount;
         if (alphabet == 0) {
@@ -216,19 +266,32 @@ public:
             // No more items to read.
             return 1;
         }
-        IndexElement* elem = _index[_itemIdx++];
+        return readItem(_itemIdx++, dataBuf, targetBuf,
+                        dataBufLen, targetBufLen, dataLen, targetLen);
+    }
+
+    // Read the item at the given position of the index. Unlike next(), this
+    // may be called from several threads at once as long as each of them
+    // passes its own buffers.
+    int readItem(int index, char** dataBuf, char** targetBuf,
+                 int* dataBufLen, int* targetBufLen,
+                 int* dataLen, int* targetLen) {
+        if (_shuffle == true) {
+            index = _order[index];
+        }
         // Read the data.
-        readFile(elem->_fileName, dataBuf, dataBufLen, dataLen);
+        readFile(_index->fileName(index), dataBuf, dataBufLen, dataLen);
         // Read the targets.
+        const char* target = _index->target(index);
         if (_targetConversion == READ_CONTENTS) {
-            readFile(elem->_targets[0], targetBuf, targetBufLen, targetLen);
+            readFile(target, targetBuf, targetBufLen, targetLen);
             return 0;
         }
 
         switch(_targetConversion) {
         case NO_CONVERSION:
         case CHAR_TO_INDEX:
-            *targetLen = elem->_targets[0].size();
+            *targetLen = _index->targetSize(index);
             break;
         case ASCII_TO_BINARY:
             *targetLen = _targetTypeSize;
@@ -243,13 +306,13 @@ public:
 
         switch(_targetConversion) {
         case NO_CONVERSION:
-            memcpy(*targetBuf, elem->_targets[0].c_str(), *targetLen);
+            memcpy(*targetBuf, target, *targetLen);
             break;
         case ASCII_TO_BINARY:
-            asciiToBinary(elem, *targetBuf);
+            asciiToBinary(target, *targetBuf);
             break;
         case CHAR_TO_INDEX:
-            charToIndex(elem, *targetBuf);
+            charToIndex(target, *targetLen, *targetBuf);
             break;
         }
 
@@ -266,7 +329,7 @@ public:
     }
 
 private:
-    void readFile(string& fileName, char**buf, int* bufLen, int* dataLen) {
+    void readFile(const char* fileName, char**buf, int* bufLen, int* dataLen) {
         string path;
         if (fileName[0] == '/') {
             path = fileName;
@@ -285,20 +348,19 @@ private:
             // Allocate a bit more than what we need right now.
             resize(buf, bufLen, size + size / 8);
         }
-        _ifs.open(path, ios::binary);
-        _ifs.read(*buf, size);
-        _ifs.close();
+        ifstream ifs(path, ios::binary);
+        ifs.exceptions(ifs.failbit);
+        ifs.read(*buf, size);
         *dataLen = size;
     }
 
-    void asciiToBinary(IndexElement* elem, char* targetBuf) {
-        int label = std::atoi(elem->_targets[0].c_str());
+    void asciiToBinary(const char* target, char* targetBuf) {
+        int label = std::atoi(target);
         memcpy(targetBuf, &label, sizeof(int));
     }
 
-    void charToIndex(IndexElement* elem, char* targetBuf) {
-        string& target = elem->_targets[0];
-        for (uint i = 0; i < target.size(); i++) {
+    void charToIndex(const char* target, int targetLen, char* targetBuf) {
+        for (int i = 0; i < targetLen; i++) {
             uchar elem = target[i];
             targetBuf[i] = _charMap[elem];
         }
@@ -319,14 +381,18 @@ private:
     }
 
     void loadIndex() {
-        _index.load(_indexFile, _shuffle);
-        _itemCount = _index.size();
+        _index = Index::get(_indexFile);
+        _itemCount = _index->size();
+        if (_shuffle == true) {
+            _index->shuffle(_order);
+        }
     }
 
 private:
-    Index                       _index;
+    shared_ptr<Index>           _index;
+    // Order in which to visit the lines of the index when shuffling.
+    vector<int>                 _order;
     int                         _itemIdx;
-    ifstream                    _ifs;
     int                         _targetTypeSize;
     int                         _targetConversion;
     string                      _alphabet;
@@ -15,7 +15,14 @@
 
 #pragma once
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <fstream>
+#include <string>
+#include <stdexcept>
 
 class IfStream : public std::ifstream {
 public:
@@ -38,6 +45,102 @@ public:
     }
 };
 
+#define HUGE_PAGE_SIZE      (2 << 20)
+
+// A whole file mapped into memory. The mapping is read only, so a stray write
+// into an item faults instead of quietly copying the page.
+//
+// If load is true, the file is read into anonymous memory instead, backed by
+// huge pages where possible. Such a copy belongs to the process and is not
+// dropped along with the page cache.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& fileName, bool load = false)
+    : _data(0), _size(0), _mapSize(0), _loaded(load) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::ios_base::failure("Could not open " + fileName);
+        }
+        struct stat stats;
+        if (fstat(fd, &stats) != 0) {
+            ::close(fd);
+            throw std::ios_base::failure("Could not stat " + fileName);
+        }
+        _size = stats.st_size;
+        _mapSize = _size;
+        if (_size > 0) {
+            void* data;
+            if (load == true) {
+                data = loadFile(fd);
+            } else {
+                data = mmap(0, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                throw std::ios_base::failure("Could not map " + fileName);
+            }
+            _data = (char*) data;
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (_data != 0) {
+            munmap(_data, _mapSize);
+        }
+    }
+
+    char* data() {
+        return _data;
+    }
+
+    size_t size() {
+        return _size;
+    }
+
+    // True if the file was read into memory rather than mapped.
+    bool loaded() {
+        return _loaded;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    void* loadFile(int fd) {
+        // Explicit huge pages need to be reserved by the administrator.
+        // Fall back to transparent huge pages if there are none.
+        _mapSize = (_size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+        void* data = mmap(0, _mapSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data == MAP_FAILED) {
+            data = mmap(0, _mapSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (data == MAP_FAILED) {
+                return data;
+            }
+            madvise(data, _mapSize, MADV_HUGEPAGE);
+        }
+        size_t done = 0;
+        while (done < _size) {
+            ssize_t result = pread(fd, (char*) data + done, _size - done, done);
+            if (result <= 0) {
+                munmap(data, _mapSize);
+                return MAP_FAILED;
+            }
+            done += result;
+        }
+        return data;
+    }
+
+private:
+    char*                       _data;
+    size_t                      _size;
+    // Length of the mapping, which may be rounded up from _size.
+    size_t                      _mapSize;
+    bool                        _loaded;
+};
+
 class OfStream : public std::ofstream {
 public:
     template <typename T>
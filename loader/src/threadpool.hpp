@@ -16,6 +16,7 @@
 #include <assert.h>
 
 #include <vector>
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -30,12 +31,13 @@ using std::mutex;
 using std::condition_variable;
 using std::unique_lock;
 using std::lock_guard;
+using std::atomic;
 
 class ThreadPool {
 public:
     explicit ThreadPool(int count)
-    : _count(count), _done(false) {
-        _stopped = new bool[count];
+    : _count(count), _done(false), _paused(false), _parked(0) {
+        _stopped = new atomic<bool>[count];
         for (int i = 0; i < count; i++) {
             _stopped[i] = false;
         }
@@ -43,7 +45,9 @@ public:
 
     virtual ~ThreadPool() {
         for (auto t : _threads) {
-            t->join();
+            if (t->joinable() == true) {
+                t->join();
+            }
             delete t;
         }
         delete[] _stopped;
@@ -56,7 +60,35 @@ public:
     }
 
     virtual void stop() {
-        _done = true;
+        {
+            lock_guard<mutex> lock(_pauseMutex);
+            _done = true;
+        }
+        _resumed.notify_all();
+    }
+
+    // Ask the threads to hold still the next time they call park(). The
+    // caller is responsible for waking up threads that are blocked on
+    // something else, so that they get there.
+    void pause() {
+        lock_guard<mutex> lock(_pauseMutex);
+        _paused = true;
+    }
+
+    // Wait until count threads are parked.
+    void waitForPark(int count) {
+        unique_lock<mutex> lock(_pauseMutex);
+        while ((_parked < count) && (_done == false)) {
+            _parkedChanged.wait(lock);
+        }
+    }
+
+    void resume() {
+        {
+            lock_guard<mutex> lock(_pauseMutex);
+            _paused = false;
+        }
+        _resumed.notify_all();
     }
 
     bool stopped() {
@@ -70,13 +102,29 @@ public:
 
     void join() {
         for (auto t : _threads) {
-            t->join();
+            if (t->joinable() == true) {
+                t->join();
+            }
         }
     }
 
 protected:
     virtual void work(int id) = 0;
 
+    void park() {
+        // Called by a thread at a point where it holds no buffers.
+        unique_lock<mutex> lock(_pauseMutex);
+        if (_paused == false) {
+            return;
+        }
+        _parked++;
+        _parkedChanged.notify_all();
+        while ((_paused == true) && (_done == false)) {
+            _resumed.wait(lock);
+        }
+        _parked--;
+    }
+
     void run(int id) {
         while (_done == false) {
             work(id);
@@ -87,6 +135,11 @@ protected:
 protected:
     int                         _count;
     vector<thread*>             _threads;
-    bool                        _done;
-    bool*                       _stopped;
+    atomic<bool>                _done;
+    atomic<bool>*               _stopped;
+    mutex                       _pauseMutex;
+    condition_variable          _resumed;
+    condition_variable          _parkedChanged;
+    bool                        _paused;
+    int                         _parked;
 };
@@ -0,0 +1,262 @@
+/*
+ Copyright 2016 Nervana Systems Inc.
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_SSE2_KERNELS 1
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+/*
+
+Out-of-place transpose of small row-major matrices into a wider destination.
+
+The loader uses this to turn a run of decoded items (one item per row) into
+the CHWN layout that the backends expect, writing each item straight into its
+column of the minibatch buffer. The matrix is walked in square tiles so that
+every output row receives a contiguous run of elements at a time. Tiles are
+transposed in registers with SSE2 (and AVX for 4 byte elements, when the CPU
+supports it). Edges that do not fill a tile fall back to scalar code.
+
+*/
+
+class Transpose {
+public:
+    // Transpose a rows x cols matrix of elemLen byte elements from src into
+    // dst. Row c of the result starts dstStride elements after row c - 1,
+    // so a block of items can be scattered straight into a wider batch.
+    static void run(const char* src, int rows, int cols, int elemLen,
+                    char* dst, int dstStride) {
+        switch (elemLen) {
+        case 1:
+            run8((const uint8_t*) src, rows, cols, (uint8_t*) dst, dstStride);
+            break;
+        case 2:
+            run16((const uint16_t*) src, rows, cols, (uint16_t*) dst, dstStride);
+            break;
+        case 4:
+            run32((const uint32_t*) src, rows, cols, (uint32_t*) dst, dstStride);
+            break;
+        case 8:
+            scalar((const uint64_t*) src, cols, 0, rows, 0, cols,
+                   (uint64_t*) dst, dstStride);
+            break;
+        default:
+            for (int c = 0; c < cols; c++) {
+                for (int r = 0; r < rows; r++) {
+                    memcpy(dst + ((long) c * dstStride + r) * elemLen,
+                           src + ((long) r * cols + c) * elemLen, elemLen);
+                }
+            }
+        }
+    }
+
+private:
+    template<typename T>
+    using Kernel = void (*)(const T* src, long srcStride,
+                            T* dst, long dstStride);
+
+    template<typename T>
+    static void scalar(const T* src, long srcStride,
+                       int rowStart, int rowEnd, int colStart, int colEnd,
+                       T* dst, long dstStride) {
+        for (int c = colStart; c < colEnd; c++) {
+            T* out = dst + c * dstStride;
+            for (int r = rowStart; r < rowEnd; r++) {
+                out[r] = src[r * srcStride + c];
+            }
+        }
+    }
+
+    template<typename T, int N>
+    static void tiled(const T* src, int rows, int cols, T* dst, long dstStride,
+                      Kernel<T> kernel) {
+        int fullRows = rows - rows % N;
+        int fullCols = cols - cols % N;
+        // Walk down the rows within each column block so that the output
+        // rows covered by the block are completed one after another.
+        for (int c = 0; c < fullCols; c += N) {
+            for (int r = 0; r < fullRows; r += N) {
+                kernel(src + (long) r * cols + c, cols,
+                       dst + c * dstStride + r, dstStride);
+            }
+        }
+        scalar(src, cols, 0, fullRows, fullCols, cols, dst, dstStride);
+        scalar(src, cols, fullRows, rows, 0, cols, dst, dstStride);
+    }
+
+    static void run8(const uint8_t* src, int rows, int cols,
+                     uint8_t* dst, long dstStride) {
+#if HAS_SSE2_KERNELS
+        if (rows >= 16) {
+            tiled<uint8_t, 16>(src, rows, cols, dst, dstStride, sse16x16u8);
+            return;
+        }
+        if (rows >= 8) {
+            tiled<uint8_t, 8>(src, rows, cols, dst, dstStride, sse8x8u8);
+            return;
+        }
+#endif
+        scalar(src, cols, 0, rows, 0, cols, dst, dstStride);
+    }
+
+    static void run16(const uint16_t* src, int rows, int cols,
+                      uint16_t* dst, long dstStride) {
+#if HAS_SSE2_KERNELS
+        if (rows >= 8) {
+            tiled<uint16_t, 8>(src, rows, cols, dst, dstStride, sse8x8u16);
+            return;
+        }
+#endif
+        scalar(src, cols, 0, rows, 0, cols, dst, dstStride);
+    }
+
+    static void run32(const uint32_t* src, int rows, int cols,
+                      uint32_t* dst, long dstStride) {
+#if HAS_SSE2_KERNELS
+        if ((rows >= 8) && (hasAvx() == true)) {
+            tiled<uint32_t, 8>(src, rows, cols, dst, dstStride, avx8x8u32);
+            return;
+        }
+        if (rows >= 4) {
+            tiled<uint32_t, 4>(src, rows, cols, dst, dstStride, sse4x4u32);
+            return;
+        }
+#endif
+        scalar(src, cols, 0, rows, 0, cols, dst, dstStride);
+    }
+
+#if HAS_SSE2_KERNELS
+    static bool hasAvx() {
+        static bool result = (__builtin_cpu_init(),
+                              __builtin_cpu_supports("avx") != 0);
+        return result;
+    }
+
+    // Each stage interleaves row i with row i + N / 2. After log2(N) such
+    // stages an N x N tile held in N registers of N elements is transposed.
+    static void sse16x16u8(const uint8_t* src, long srcStride,
+                           uint8_t* dst, long dstStride) {
+        __m128i a[16];
+        __m128i b[16];
+        for (int i = 0; i < 16; i++) {
+            a[i] = _mm_loadu_si128((const __m128i*) (src + i * srcStride));
+        }
+        for (int stage = 0; stage < 4; stage++) {
+            for (int i = 0; i < 8; i++) {
+                b[2 * i] = _mm_unpacklo_epi8(a[i], a[i + 8]);
+                b[2 * i + 1] = _mm_unpackhi_epi8(a[i], a[i + 8]);
+            }
+            memcpy(a, b, sizeof(a));
+        }
+        for (int i = 0; i < 16; i++) {
+            _mm_storeu_si128((__m128i*) (dst + i * dstStride), a[i]);
+        }
+    }
+
+    static void sse8x8u8(const uint8_t* src, long srcStride,
+                         uint8_t* dst, long dstStride) {
+        __m128i a[8];
+        for (int i = 0; i < 8; i++) {
+            a[i] = _mm_loadl_epi64((const __m128i*) (src + i * srcStride));
+        }
+        // Pairs of rows, then quads of rows, then all eight rows. Each
+        // result register holds two output rows.
+        __m128i b0 = _mm_unpacklo_epi8(a[0], a[1]);
+        __m128i b1 = _mm_unpacklo_epi8(a[2], a[3]);
+        __m128i b2 = _mm_unpacklo_epi8(a[4], a[5]);
+        __m128i b3 = _mm_unpacklo_epi8(a[6], a[7]);
+        __m128i c0 = _mm_unpacklo_epi16(b0, b1);
+        __m128i c1 = _mm_unpackhi_epi16(b0, b1);
+        __m128i c2 = _mm_unpacklo_epi16(b2, b3);
+        __m128i c3 = _mm_unpackhi_epi16(b2, b3);
+        __m128i d[4] = {_mm_unpacklo_epi32(c0, c2), _mm_unpackhi_epi32(c0, c2),
+                        _mm_unpacklo_epi32(c1, c3), _mm_unpackhi_epi32(c1, c3)};
+        for (int i = 0; i < 4; i++) {
+            _mm_storel_epi64((__m128i*) (dst + (2 * i) * dstStride), d[i]);
+            _mm_storel_epi64((__m128i*) (dst + (2 * i + 1) * dstStride),
+                             _mm_unpackhi_epi64(d[i], d[i]));
+        }
+    }
+
+    static void sse8x8u16(const uint16_t* src, long srcStride,
+                          uint16_t* dst, long dstStride) {
+        __m128i a[8];
+        __m128i b[8];
+        for (int i = 0; i < 8; i++) {
+            a[i] = _mm_loadu_si128((const __m128i*) (src + i * srcStride));
+        }
+        for (int stage = 0; stage < 3; stage++) {
+            for (int i = 0; i < 4; i++) {
+                b[2 * i] = _mm_unpacklo_epi16(a[i], a[i + 4]);
+                b[2 * i + 1] = _mm_unpackhi_epi16(a[i], a[i + 4]);
+            }
+            memcpy(a, b, sizeof(a));
+        }
+        for (int i = 0; i < 8; i++) {
+            _mm_storeu_si128((__m128i*) (dst + i * dstStride), a[i]);
+        }
+    }
+
+    static void sse4x4u32(const uint32_t* src, long srcStride,
+                          uint32_t* dst, long dstStride) {
+        __m128i a0 = _mm_loadu_si128((const __m128i*) (src));
+        __m128i a1 = _mm_loadu_si128((const __m128i*) (src + srcStride));
+        __m128i a2 = _mm_loadu_si128((const __m128i*) (src + 2 * srcStride));
+        __m128i a3 = _mm_loadu_si128((const __m128i*) (src + 3 * srcStride));
+        __m128i b0 = _mm_unpacklo_epi32(a0, a1);
+        __m128i b1 = _mm_unpacklo_epi32(a2, a3);
+        __m128i b2 = _mm_unpackhi_epi32(a0, a1);
+        __m128i b3 = _mm_unpackhi_epi32(a2, a3);
+        _mm_storeu_si128((__m128i*) (dst), _mm_unpacklo_epi64(b0, b1));
+        _mm_storeu_si128((__m128i*) (dst + dstStride), _mm_unpackhi_epi64(b0, b1));
+        _mm_storeu_si128((__m128i*) (dst + 2 * dstStride), _mm_unpacklo_epi64(b2, b3));
+        _mm_storeu_si128((__m128i*) (dst + 3 * dstStride), _mm_unpackhi_epi64(b2, b3));
+    }
+
+    __attribute__((target("avx")))
+    static void avx8x8u32(const uint32_t* src, long srcStride,
+                          uint32_t* dst, long dstStride) {
+        __m256 a[8];
+        for (int i = 0; i < 8; i++) {
+            a[i] = _mm256_loadu_ps((const float*) (src + i * srcStride));
+        }
+        __m256 b[8];
+        for (int i = 0; i < 4; i++) {
+            b[2 * i] = _mm256_unpacklo_ps(a[2 * i], a[2 * i + 1]);
+            b[2 * i + 1] = _mm256_unpackhi_ps(a[2 * i], a[2 * i + 1]);
+        }
+        __m256 c[8];
+        for (int i = 0; i < 2; i++) {
+            c[4 * i] = _mm256_shuffle_ps(b[4 * i], b[4 * i + 2], 0x44);
+            c[4 * i + 1] = _mm256_shuffle_ps(b[4 * i], b[4 * i + 2], 0xEE);
+            c[4 * i + 2] = _mm256_shuffle_ps(b[4 * i + 1], b[4 * i + 3], 0x44);
+            c[4 * i + 3] = _mm256_shuffle_ps(b[4 * i + 1], b[4 * i + 3], 0xEE);
+        }
+        for (int i = 0; i < 4; i++) {
+            _mm256_storeu_ps((float*) (dst + i * dstStride),
+                             _mm256_permute2f128_ps(c[i], c[i + 4], 0x20));
+            _mm256_storeu_ps((float*) (dst + (i + 4) * dstStride),
+                             _mm256_permute2f128_ps(c[i], c[i + 4], 0x31));
+        }
+    }
+#endif
+};
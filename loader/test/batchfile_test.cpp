@@ -0,0 +1,185 @@
+/*
+ Copyright 2016 Nervana Systems Inc.
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include "buffer.hpp"
+#include "batchfile.hpp"
+
+// Code for unit testing.
+
+// The archive header follows the record header of "cpiohdr", and the index
+// offset is the eleventh word of the header.
+const int indexOffsetPos = sizeof(RecordHeader) + 8 + 40;
+const int itemCount = 7;
+
+ByteVect makeDatum(int item) {
+    // Odd and even lengths, so that the records are padded.
+    ByteVect datum(100 + 37 * item);
+    for (uint i = 0; i < datum.size(); i++) {
+        datum[i] = (char) (item * 31 + i);
+    }
+    return datum;
+}
+
+ByteVect makeTarget(int item) {
+    return ByteVect(sizeof(int) + item % 2, (char) item);
+}
+
+ByteVect readFile(const string& fileName) {
+    ByteVect contents;
+    int result = readFileBytes(fileName, contents);
+    assert(result == 0);
+    (void) result;
+    return contents;
+}
+
+void writeFile(const string& fileName, const ByteVect& contents) {
+    std::ofstream ofs(fileName, std::ofstream::binary | std::ofstream::trunc);
+    ofs.write(&contents[0], contents.size());
+}
+
+uint indexOffset(const ByteVect& contents) {
+    uint result;
+    memcpy(&result, &contents[indexOffsetPos], sizeof(result));
+    return result;
+}
+
+void setIndexOffset(ByteVect& contents, uint offset) {
+    memcpy(&contents[indexOffsetPos], &offset, sizeof(offset));
+}
+
+bool equal(CharBuffer& buffer, const ByteVect& expected) {
+    int len;
+    char* item = buffer.getItem(0, len);
+    return (len == (int) expected.size()) &&
+           (memcmp(item, &expected[0], len) == 0);
+}
+
+// Read the items of an archive back out of order, then in order.
+bool check(const string& fileName, const string& description) {
+    CharBuffer dataBuffer(0);
+    CharBuffer targetBuffer(0);
+    BufferTuple buffers = make_tuple(&dataBuffer, &targetBuffer, (IntBuffer*) 0);
+    try {
+        BatchFile batchFile;
+        batchFile.openForRead(fileName);
+        if (batchFile.itemCount() != itemCount) {
+            printf("FAILED: %s has %d items, expected %d\n",
+                   description.c_str(), batchFile.itemCount(), itemCount);
+            return false;
+        }
+        for (int i = itemCount - 1; i >= 0; i--) {
+            dataBuffer.reset();
+            targetBuffer.reset();
+            batchFile.readItem(i, buffers);
+            if ((equal(dataBuffer, makeDatum(i)) == false) ||
+                (equal(targetBuffer, makeTarget(i)) == false) ||
+                (batchFile.itemSize(i) !=
+                 makeDatum(i).size() + makeTarget(i).size())) {
+                printf("FAILED: item %d of %s differs\n", i,
+                       description.c_str());
+                return false;
+            }
+        }
+        batchFile.close();
+        batchFile.openForRead(fileName);
+        for (int i = 0; i < itemCount; i++) {
+            dataBuffer.reset();
+            targetBuffer.reset();
+            batchFile.readItem(buffers);
+            if ((equal(dataBuffer, makeDatum(i)) == false) ||
+                (equal(targetBuffer, makeTarget(i)) == false)) {
+                printf("FAILED: item %d of %s differs when read in order\n",
+                       i, description.c_str());
+                return false;
+            }
+        }
+    } catch (std::exception& ex) {
+        printf("FAILED: reading %s: %s\n", description.c_str(), ex.what());
+        return false;
+    }
+    printf("read %s\n", description.c_str());
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: %s work_dir\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    string archiveName = string(argv[1]) + "/batchfile_test.cpio";
+    string damagedName = string(argv[1]) + "/batchfile_test_damaged.cpio";
+    {
+        BatchFile batchFile;
+        batchFile.openForWrite(archiveName, "test");
+        for (int i = 0; i < itemCount; i++) {
+            ByteVect datum = makeDatum(i);
+            ByteVect target = makeTarget(i);
+            batchFile.writeItem(datum, target);
+        }
+        batchFile.close();
+    }
+    ByteVect contents = readFile(archiveName);
+    uint offset = indexOffset(contents);
+    bool passed = (offset != 0) && (offset < contents.size());
+    if (passed == false) {
+        printf("FAILED: archive has no index\n");
+    }
+    passed &= check(archiveName, "an indexed archive");
+
+    // Archives written before the index was added have a zero offset and
+    // end with the trailer right after the last item.
+    ByteVect old(contents.begin(), contents.begin() + offset);
+    setIndexOffset(old, 0);
+    ByteVect trailer(contents.end() - (sizeof(RecordHeader) + 8 + 16 +
+                                       sizeof(RecordHeader) +
+                                       sizeof(CPIO_FOOTER) + 1),
+                     contents.end());
+    old.insert(old.end(), trailer.begin(), trailer.end());
+    writeFile(damagedName, old);
+    passed &= check(damagedName, "an archive without an index");
+
+    // A damaged index is ignored and the archive walked instead.
+    ByteVect truncated(contents.begin(),
+                       contents.begin() + offset + sizeof(RecordHeader) + 20);
+    writeFile(damagedName, truncated);
+    passed &= check(damagedName, "an archive with a truncated index");
+
+    ByteVect corrupt = contents;
+    memset(&corrupt[offset + sizeof(RecordHeader) + 8], 0xFF,
+           itemCount * sizeof(ItemOffset));
+    writeFile(damagedName, corrupt);
+    passed &= check(damagedName, "an archive with a corrupt index");
+
+    ByteVect misplaced = contents;
+    setIndexOffset(misplaced, 0xFFFFFF00);
+    writeFile(damagedName, misplaced);
+    passed &= check(damagedName, "an archive with an index past its end");
+
+    unlink(archiveName.c_str());
+    unlink(damagedName.c_str());
+    if (passed == false) {
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
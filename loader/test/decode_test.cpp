@@ -1,17 +1,121 @@
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
+#include <malloc.h>
+
 #include <vector>
 #include <string>
 #include <sstream>
 #include <cstdio>
+#include <atomic>
 #include "buffer.hpp"
 #include "batchfile.hpp"
 #include "image.hpp"
 
+// Count heap allocations made while counting is on. operator new and
+// OpenCV both get their memory through these.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+std::atomic<bool> counting(false);
+std::atomic<long> allocationCount(0);
+// Allocations that are at least as large as this.
+std::atomic<long> largeAllocationCount(0);
+size_t largeAllocationSize = 0;
+
+void countAllocation(size_t size) {
+    if (counting == true) {
+        allocationCount++;
+        if (size >= largeAllocationSize) {
+            largeAllocationCount++;
+        }
+    }
+}
+
+extern "C" void* malloc(size_t size) {
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size) {
+    countAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) {
+    countAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    countAllocation(size);
+    *ptr = __libc_memalign(alignment, size);
+    return (*ptr == 0) ? ENOMEM : 0;
+}
+
+// Store an item as raw pixels at full size.
+ByteVect storeRaw(Image& ingester, const ByteVect& item) {
+    int bufLen = item.size();
+    int len = item.size();
+    char* buf = new char[bufLen];
+    memcpy(buf, &item[0], len);
+    ingester.ingest(&buf, &bufLen, &len);
+    ByteVect result(buf, buf + len);
+    delete[] buf;
+    return result;
+}
+
+// Transform the items once to grow the buffers of the image to fit them,
+// then count the allocations of transforming them another few times.
+long countAllocations(Image& image, vector<ByteVect>& items, int passes,
+                      char* buf, int bufSize) {
+    for (auto& item : items) {
+        image.transform(&item[0], item.size(), buf, bufSize, 0);
+    }
+    allocationCount = 0;
+    largeAllocationCount = 0;
+    counting = true;
+    for (int pass = 0; pass < passes; pass++) {
+        for (auto& item : items) {
+            image.transform(&item[0], item.size(), buf, bufSize, 0);
+        }
+    }
+    counting = false;
+    return allocationCount;
+}
+
+// Mean absolute difference between an image and the planes of an output.
+double meanDifference(const Mat& expected, const ByteVect& planes) {
+    double difference = 0;
+    int area = expected.rows * expected.cols;
+    for (int y = 0; y < expected.rows; y++) {
+        const uchar* row = expected.ptr(y);
+        for (int x = 0; x < expected.cols; x++) {
+            for (int c = 0; c < 3; c++) {
+                int actual = (uint8_t) planes[c * area + y * expected.cols + x];
+                difference += abs(actual - row[3 * x + c]);
+            }
+        }
+    }
+    return difference / (3 * area);
+}
+
 int main (int argc, char **argv) {
     ImageParams *imgp = new ImageParams(3, 224, 224, false, true, // channels, h, w, augment, flip
         20, 100,   // Scale Params
@@ -28,11 +132,24 @@ int main (int argc, char **argv) {
     string batchFileName(argv[1]);
     bf.openForRead(batchFileName);
 
+    CharBuffer dataBuffer(0);
+    CharBuffer targetBuffer(0);
+    BufferTuple buffers = make_tuple(&dataBuffer, &targetBuffer, (IntBuffer*) 0);
     // Just get a single item
-    auto dpair = bf.readItem();
+    bf.readItem(0, buffers);
+    int len;
+    char* item = dataBuffer.getItem(0, len);
+    ByteVect data(item, item + len);
+    item = targetBuffer.getItem(0, len);
+    ByteVect labels(item, item + len);
+    // And a few more to check allocations with.
+    vector<ByteVect> items(1, data);
+    for (int i = 1; (i < 8) && (i < bf.itemCount()); i++) {
+        bf.readItem(i, buffers);
+        item = dataBuffer.getItem(i, len);
+        items.push_back(ByteVect(item, item + len));
+    }
     bf.close();
-    ByteVect data = *(dpair.first);
-    ByteVect labels = *(dpair.second);
 
     int label_idx = *reinterpret_cast<int *>(&labels[0]);
     // We'll do 10 decodings of the same image;
@@ -48,6 +165,151 @@ int main (int argc, char **argv) {
         decoder.transform(&data[0], data.size(), &outbuf[i * num_pixels], num_pixels, 0);
     }
 
+    // In steady state, transforming an image may only allocate the scratch
+    // space that OpenCV functions take for themselves. Run single-threaded
+    // and without IPP, cv::resize() and cv::warpAffine() take one or two
+    // buffers per transform between them, and the bound leaves room for
+    // twice that. Temporary matrices or memory for a decoder on every image
+    // take more and are caught. The items are
+    // checked as raw pixels, and as JPEG images where libjpeg decodes them,
+    // since cv::imdecode() allocates for itself.
+    cv::setNumThreads(0);
+#if CV_MAJOR_VERSION >= 3
+    cv::ipp::setUseIPP(false);
+#endif
+    const long scratchAllocations = 4;
+    int passes = 2;
+    largeAllocationSize = num_pixels;
+    ImageIngestParams keepParams(false, false, 0, 0, true);
+    Image rawStorer(imgp, &keepParams, 0);
+    vector<ByteVect> rawItems;
+    for (auto& item : items) {
+        rawItems.push_back(storeRaw(rawStorer, item));
+    }
+    vector<vector<ByteVect>*> itemSets(1, &rawItems);
+#if HAS_JPEGLIB
+    itemSets.push_back(&items);
+#endif
+    for (auto itemSet : itemSets) {
+        Image allocDecoder(imgp, iip, 0);
+        long count = countAllocations(allocDecoder, *itemSet, passes,
+                                      &outbuf[0], num_pixels);
+        long transforms = passes * itemSet->size();
+        std::cout << "allocations in " << transforms << " transforms of " <<
+                     itemSet->size() << (itemSet == &rawItems ? " raw" : "") <<
+                     " images: " << count << ", of at least " << num_pixels <<
+                     " bytes: " << largeAllocationCount << std::endl;
+        if ((largeAllocationCount != 0) ||
+            (count > transforms * scratchAllocations)) {
+            std::cout << "FAILED: allocations in steady state" << std::endl;
+            return 1;
+        }
+    }
+
+    // Store the image as raw pixels with the short side resized to 64 and
+    // check that the stored shape is the one asked for.
+    ImageIngestParams rawParams(true, false, 64, 64, true);
+    Image rawIngester(imgp, &rawParams, 0);
+    int rawBufLen = data.size();
+    int rawLen = data.size();
+    char* rawBuf = new char[rawBufLen];
+    memcpy(rawBuf, &data[0], rawLen);
+    rawIngester.ingest(&rawBuf, &rawBufLen, &rawLen);
+    Mat original = cv::imdecode(Mat(1, data.size(), CV_8UC1, &data[0]),
+                                CV_LOAD_IMAGE_COLOR);
+    int width = original.cols;
+    int height = original.rows;
+    if (width <= height) {
+        height = height * 64 / width;
+        width = 64;
+    } else {
+        width = width * 64 / height;
+        height = 64;
+    }
+    RawImageHeader header;
+    if ((header.read(rawBuf, rawLen) == false) ||
+        (header._height != height) || (header._width != width) ||
+        (header._channelCount != 3)) {
+        std::cout << "FAILED: raw image is " << header._width << "x" <<
+                     header._height << ", expected " << width << "x" <<
+                     height << std::endl;
+        return 1;
+    }
+    ByteVect rawOutbuf(num_pixels);
+    rawIngester.transform(rawBuf, rawLen, &rawOutbuf[0], num_pixels, 0);
+    delete[] rawBuf;
+
+    // A rotated crop that is scaled down has to come out like rotating the
+    // whole image, cropping and resizing with area averaging did before,
+    // up to interpolation. The image is stored as raw pixels at full size,
+    // so that both start from the same pixels.
+    ImageParams warpParams(3, 64, 64, true, true, 64, 64, 100, 100,
+                           10, 10, 0, false, 0, 0, 0, 0);
+    Image warper(&warpParams, &keepParams, 0);
+    ByteVect rawData = storeRaw(warper, data);
+    int warp_pixels = warpParams.getSize().area() * 3;
+    ByteVect warpOutbuf(warp_pixels);
+    warper.transform(&rawData[0], rawData.size(), &warpOutbuf[0], warp_pixels, 0);
+
+    cv::RNG rng(0);
+    AugParams agp;
+    warpParams.getDistortionValues(rng, original.size(), &agp);
+    Mat rotated;
+    Point2i center(original.cols / 2, original.rows / 2);
+    cv::warpAffine(original, rotated,
+                   cv::getRotationMatrix2D(center, agp.angle, 1.0),
+                   original.size());
+    Mat expected;
+    cv::resize(rotated(agp.cropBox), expected, warpParams.getSize(),
+               0, 0, CV_INTER_AREA);
+    if (agp.flip) {
+        cv::flip(expected, expected, 1);
+    }
+    double difference = meanDifference(expected, warpOutbuf);
+    std::cout << "mean difference of a rotated, downscaled crop: " <<
+                 difference << std::endl;
+    if (difference > 6) {
+        std::cout << "FAILED: rotated crop differs from the old pipeline" <<
+                     std::endl;
+        return 1;
+    }
+
+    // A JPEG image that is to be shown rotated has to come out as if
+    // cv::imdecode() had decoded it, whether or not libjpeg is used.
+    if (((uint8_t) data[0] == 0xFF) && ((uint8_t) data[1] == 0xD8)) {
+        // APP1 marker with EXIF data that sets the orientation to 6.
+        static const uint8_t exif[] = {
+            0xFF, 0xE1, 0, 34, 'E', 'x', 'i', 'f', 0, 0,
+            'M', 'M', 0, 42, 0, 0, 0, 8,
+            0, 1, 0x01, 0x12, 0, 3, 0, 0, 0, 1, 0, 6, 0, 0,
+            0, 0, 0, 0};
+        ByteVect oriented(data.begin(), data.begin() + 2);
+        oriented.insert(oriented.end(), exif, exif + sizeof(exif));
+        oriented.insert(oriented.end(), data.begin() + 2, data.end());
+        ImageParams orientParams(3, 32, 32, true, false, 32, 32, 100, 100,
+                                 0, 0, 0, false, 0, 0, 0, 0);
+        Image orientDecoder(&orientParams, 0, 0);
+        int orient_pixels = orientParams.getSize().area() * 3;
+        ByteVect orientOutbuf(orient_pixels);
+        orientDecoder.transform(&oriented[0], oriented.size(),
+                                &orientOutbuf[0], orient_pixels, 0);
+
+        Mat shown = cv::imdecode(Mat(1, oriented.size(), CV_8UC1, &oriented[0]),
+                                 CV_LOAD_IMAGE_COLOR);
+        cv::RNG orientRng(0);
+        orientParams.getDistortionValues(orientRng, shown.size(), &agp);
+        cv::resize(shown(agp.cropBox), expected, orientParams.getSize(),
+                   0, 0, CV_INTER_AREA);
+        difference = meanDifference(expected, orientOutbuf);
+        std::cout << "mean difference of an oriented JPEG image: " <<
+                     difference << std::endl;
+        if (difference != 0) {
+            std::cout << "FAILED: oriented JPEG image decoded differently" <<
+                         std::endl;
+            return 1;
+        }
+    }
+
     std::ofstream file (argv[2], std::ofstream::out | std::ofstream::binary);
     file.write((char *) &num_decode, sizeof(int));
     file.write((char *) &num_pixels, sizeof(int));
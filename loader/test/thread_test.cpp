@@ -78,10 +78,24 @@ int multi(Loader* loader, int epochCount, int minibatchCount,
     for (int epoch = 0; epoch < epochCount; epoch++) {
         loader->reset();
         for (int i = 0; i < minibatchCount; i++) {
+            if (epoch % 2 == 1) {
+                // The copying variant has to hand out the same minibatches.
+                loader->next(&data, &targets);
+                sm += sum(data._data, dataBufSize);
+                sm += sum(targets._data, targetsBufSize);
+                continue;
+            }
             loader->next();
-            int bufIdx = i % 2;
+            int bufIdx = i % device->_count;
             device->copyDataBack(bufIdx, &data);
             device->copyLabelsBack(bufIdx, &targets);
+            int* meta = device->getMetaPtr(bufIdx);
+            if (meta != 0) {
+                // The second half holds the target lengths.
+                for (int j = 0; j < batchSize; j++) {
+                    assert(meta[batchSize + j] == targetSize);
+                }
+            }
             sm += sum(data._data, dataBufSize);
             sm += sum(targets._data, targetsBufSize);
         }
@@ -91,7 +105,7 @@ int multi(Loader* loader, int epochCount, int minibatchCount,
 }
 
 int test(char* repoDir, char* indexFile,
-         int batchSize, int nchan, int height, int width) {
+         int batchSize, int nchan, int height, int width, bool withMeta) {
     int datumSize = nchan * height * width;
     int targetSize = 1;
     int datumTypeSize = 1;
@@ -105,24 +119,26 @@ int test(char* repoDir, char* indexFile,
 
     ImageParams mediaParams(nchan, height, width, true, false, 0, 0, 100, 100,
                             0, 0, 0, false, 0, 0, 0, 0);
-    char* dataBuffer[2];
-    char* targetBuffer[2];
-    int* meta[2];
-    for (int i = 0; i < 2; i++) {
+    const int prefetchDepth = 2;
+    char* dataBuffer[prefetchDepth];
+    char* targetBuffer[prefetchDepth];
+    int* meta[prefetchDepth];
+    for (int i = 0; i < prefetchDepth; i++) {
         dataBuffer[i] = new char[batchSize * datumLen];
         targetBuffer[i] = new char[batchSize * targetLen];
-        meta[i] = 0;
+        // Metadata is optional. Decoding must work without it.
+        meta[i] = (withMeta == true) ? new int[2 * batchSize] : 0;
     }
 
     string archiveDir(repoDir);
     archiveDir += "-ingested";
-    CpuParams deviceParams(0, 0, dataBuffer, targetBuffer, meta);
+    CpuParams deviceParams(0, 0, prefetchDepth, dataBuffer, targetBuffer, meta);
     ImageIngestParams ingestParams(false, true, 0, 0);
     Loader loader(&itemCount, batchSize, repoDir, archiveDir.c_str(),
                   indexFile, "archive-",
                   false, false, 0, datumSize, datumTypeSize,
                   targetSize, targetTypeSize, targetConversion, 100,
-                  &mediaParams, &deviceParams, &ingestParams, 0);
+                  prefetchDepth, 0, 1, 2, 0, &mediaParams, &deviceParams, &ingestParams, 0);
     unsigned int singleSum = single(&loader, epochCount,
                                     minibatchCount, batchSize,
                                     datumLen, targetLen,
@@ -130,9 +146,10 @@ int test(char* repoDir, char* indexFile,
     unsigned int multiSum = multi(&loader, epochCount,
                                   minibatchCount, batchSize,
                                   datumLen, targetLen);
-    for (int i = 0; i < 2; i++) {
+    for (int i = 0; i < prefetchDepth; i++) {
         delete[] dataBuffer[i];
         delete[] targetBuffer[i];
+        delete[] meta[i];
     }
     printf("sum %u true sum %u\n", multiSum, singleSum);
     assert(multiSum == singleSum);
@@ -152,5 +169,6 @@ int main(int argc, char** argv) {
     char* repoDir = argv[1];
     char* indexFile = argv[2];
 
-    test(repoDir, indexFile, batchSize, nchan, height, width);
+    test(repoDir, indexFile, batchSize, nchan, height, width, false);
+    test(repoDir, indexFile, batchSize, nchan, height, width, true);
 }
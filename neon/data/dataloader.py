@@ -25,15 +25,16 @@ from .dataiterator import NervanaDataIterator
 logger = logging.getLogger(__name__)
 
 
-BufferPair = (ct.c_void_p) * 2
-
-
 class DeviceParams(ct.Structure):
+    """
+    This must be kept in sync with loader/src/device.hpp.
+    """
     _fields_ = [('type', ct.c_int),
                 ('id', ct.c_int),
-                ('data', BufferPair),
-                ('targets', BufferPair),
-                ('meta', BufferPair)]
+                ('count', ct.c_int),
+                ('data', ct.POINTER(ct.c_void_p)),
+                ('targets', ct.POINTER(ct.c_void_p)),
+                ('meta', ct.POINTER(ct.c_void_p))]
 
 
 class DataLoader(NervanaDataIterator):
@@ -80,8 +81,9 @@ class DataLoader(NervanaDataIterator):
             ingested.
         reshuffle (boolean, optional):
             Whether to reshuffle the order of data examples as they are loaded.
-            If this is set to True, the order is reshuffled for each epoch.
-            Useful for batch normalization.  Defaults to False.
+            If this is set to True, the order is reshuffled across the whole
+            dataset for each epoch.  Useful for batch normalization.  Defaults
+            to False.
         datum_type (data-type, optional):
             Data type of input data.  Defaults to np.uint8.
         target_type (data-type, optional):
@@ -100,6 +102,25 @@ class DataLoader(NervanaDataIterator):
         alphabet (str, optional):
             Alphabet to use for converting string labels.  This is only
             applicable if target_conversion is set to "char_to_index".
+        prefetch_depth (int, optional):
+            Number of minibatches to buffer at each stage of the loading
+            pipeline.  Larger values help absorb bursts of storage latency at
+            the cost of extra host and device memory.  Defaults to 2.
+        readahead_mb (int, optional):
+            Number of megabytes of upcoming archive data that the operating
+            system is asked to load ahead of time.  Set this to 0 to disable
+            readahead.  Defaults to 1024.
+        read_threads (int, optional):
+            Number of threads that read archives.  Minibatches are delivered
+            in the same order regardless.  More threads help keep fast
+            storage busy.  Defaults to 2.
+        ingest_ahead (int, optional):
+            Number of archives to build ahead of the one being read while the
+            dataset is ingested for the first time.  Defaults to 2.
+        cache_mb (int, optional):
+            Number of megabytes of archives to keep in memory after they are
+            first read, so that later epochs do not touch the file system.
+            Set this to 0 to disable the cache.  Defaults to 0.
     """
 
     _converters_ = {'no_conversion': 0,
@@ -115,9 +136,22 @@ class DataLoader(NervanaDataIterator):
                  datum_dtype=np.uint8, target_dtype=np.int32,
                  onehot=True, nclasses=None, subset_percent=100,
                  ingest_params=None,
-                 alphabet=None):
+                 alphabet=None,
+                 prefetch_depth=2,
+                 readahead_mb=1024, read_threads=2, ingest_ahead=2,
+                 cache_mb=0):
         if onehot is True and nclasses is None:
             raise ValueError('nclasses must be specified for one-hot labels')
+        if prefetch_depth < 1:
+            raise ValueError('prefetch_depth must be at least 1')
+        if readahead_mb < 0:
+            raise ValueError('readahead_mb must not be negative')
+        if read_threads < 1:
+            raise ValueError('read_threads must be at least 1')
+        if ingest_ahead < 0:
+            raise ValueError('ingest_ahead must not be negative')
+        if cache_mb < 0:
+            raise ValueError('cache_mb must not be negative')
         if target_conversion not in self._converters_:
             raise ValueError('Unknown target type %s' % target_conversion)
 
@@ -134,6 +168,7 @@ class DataLoader(NervanaDataIterator):
         self.bsz = self.be.bsz
         self.buffer_id = 0
         self.start_idx = 0
+        self.epoch_done = True
         self.media_params = media_params
         self.shape = media_params.get_shape()
         self.datum_size = media_params.datum_size()
@@ -153,6 +188,11 @@ class DataLoader(NervanaDataIterator):
         self.nclasses = nclasses
         self.subset_percent = int(subset_percent)
         self.ingest_params = ingest_params
+        self.prefetch_depth = int(prefetch_depth)
+        self.readahead_mb = int(readahead_mb)
+        self.read_threads = int(read_threads)
+        self.ingest_ahead = int(ingest_ahead)
+        self.cache_mb = int(cache_mb)
         if alphabet is None:
             self.alphabet = None
         else:
@@ -175,20 +215,27 @@ class DataLoader(NervanaDataIterator):
     def alloc(self):
 
         def alloc_bufs(dim0, dtype):
-            return [self.be.iobuf(dim0=dim0, dtype=dtype) for _ in range(2)]
+            return [self.be.iobuf(dim0=dim0, dtype=dtype)
+                    for _ in range(self.prefetch_depth)]
 
         def ct_cast(buffers, idx):
             return ct.cast(int(buffers[idx].raw()), ct.c_void_p)
 
         def cast_bufs(buffers):
-            return BufferPair(ct_cast(buffers, 0), ct_cast(buffers, 1))
+            ptrs = (ct.c_void_p * self.prefetch_depth)(
+                *[ct_cast(buffers, idx) for idx in range(self.prefetch_depth)])
+            # The loader library keeps pointers into this array.
+            self.buffer_ptrs.append(ptrs)
+            return ct.cast(ptrs, ct.POINTER(ct.c_void_p))
 
         self.data = alloc_bufs(self.datum_size, self.datum_dtype)
         self.targets = alloc_bufs(self.target_size, self.target_dtype)
         self.meta = alloc_bufs(2, np.int32)
         self.media_params.alloc(self)
+        self.buffer_ptrs = []
         self.device_params = DeviceParams(self.be.device_type,
                                           self.be.device_id,
+                                          self.prefetch_depth,
                                           cast_bufs(self.data),
                                           cast_bufs(self.targets),
                                           cast_bufs(self.meta))
@@ -203,6 +250,10 @@ class DataLoader(NervanaDataIterator):
 
     @property
     def nbatches(self):
+        # The last minibatch of an epoch is topped up with the first items
+        # of the next epoch, which then starts at start_idx. Every item is
+        # seen once per epoch, so the number of minibatches can differ by
+        # one from epoch to epoch.
         return -((self.start_idx - self.ndata) // self.bsz)
 
     def start(self):
@@ -212,7 +263,11 @@ class DataLoader(NervanaDataIterator):
         if not os.path.exists(self.archive_dir):
             logger.warning('%s not found. Triggering data ingest...' % self.archive_dir)
             os.makedirs(self.archive_dir)
-        if self.item_count.value == 0:
+        if self.item_count.value == 0 and os.path.isdir(self.repo_dir):
+            # The index is needed to rebuild archives even when there is a
+            # manifest, because the manifest may turn out to be stale. The
+            # indexer does nothing if the index file exists. Without the
+            # source images, the loader has to go by the manifest alone.
             indexer = Indexer(self.repo_dir, self.index_file)
             indexer.run()
         datum_dtype_size = np.dtype(self.datum_dtype).itemsize
@@ -233,11 +288,19 @@ class DataLoader(NervanaDataIterator):
             ct.c_int(self.target_size), ct.c_int(target_dtype_size),
             ct.c_int(self.target_conversion),
             self.subset_percent,
+            ct.c_int(self.prefetch_depth),
+            ct.c_int(self.readahead_mb),
+            ct.c_int(self.read_threads),
+            ct.c_int(self.ingest_ahead),
+            ct.c_int(self.cache_mb),
             ct.POINTER(MediaParams)(self.media_params),
             ct.POINTER(DeviceParams)(self.device_params),
             ingest_params,
             self.alphabet)
         self.ndata = self.item_count.value
+        self.buffer_id = 0
+        self.start_idx = 0
+        self.epoch_done = True
         if self.loader is None:
             raise RuntimeError('Failed to start data loader.')
 
@@ -251,15 +314,21 @@ class DataLoader(NervanaDataIterator):
         """
         Restart data from index 0
         """
+        if self.epoch_done:
+            # The loader is already streaming the next epoch.
+            return
         self.buffer_id = 0
         self.start_idx = 0
+        self.epoch_done = True
         self.loaderlib.reset(self.loader)
 
-    def next(self, start):
-        end = min(start + self.bsz, self.ndata)
-        if end == self.ndata:
-            self.start_idx = self.bsz - (self.ndata - start)
-        self.loaderlib.next(self.loader)
+    def next(self):
+        # The loader flags the last minibatch of each epoch. That minibatch
+        # is topped up with items from the start of the next epoch.
+        self.epoch_done = (self.loaderlib.next(self.loader) == 1)
+        if self.epoch_done:
+            self.start_idx = ((self.start_idx + self.nbatches * self.bsz -
+                               self.ndata) % self.ndata)
 
         if self.backend_data is None:
             data = self.data[self.buffer_id]
@@ -277,9 +346,12 @@ class DataLoader(NervanaDataIterator):
             targets = self.targets[self.buffer_id]
 
         meta = self.meta[self.buffer_id]
-        self.buffer_id = 1 if self.buffer_id == 0 else 0
+        self.buffer_id = (self.buffer_id + 1) % self.prefetch_depth
         return self.media_params.process(self, data, targets, meta)
 
     def __iter__(self):
-        for start in range(self.start_idx, self.ndata, self.bsz):
-            yield self.next(start)
+        while True:
+            batch = self.next()
+            yield batch
+            if self.epoch_done:
+                break
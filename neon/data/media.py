@@ -112,6 +112,12 @@ class ImageParams(MediaParams):
             The mean of red pixel values.
         gray_mean (int):
             The mean of gray pixel values.
+        decode_cache_mb (int):
+            Megabytes of memory to keep decoded images in, so that each image
+            only needs to be decoded once as long as it fits. A copy of the
+            encoded image is kept with each decoded image and counts towards
+            this budget. The random augmentations are still applied afresh
+            every time. Defaults to 0, which disables the cache.
 """
     _fields_ = [('channel_count', ct.c_int),
                 ('height', ct.c_int),
@@ -130,7 +136,9 @@ class ImageParams(MediaParams):
                 ('green_mean', ct.c_int),
                 ('red_mean', ct.c_int),
                 ('gray_mean', ct.c_int),
-                ('color_noise_std', ct.c_float)]
+                ('color_noise_std', ct.c_float),
+                ('decode_cache_mb', ct.c_int),
+                ('decode_cache', ct.c_void_p)]
     _defaults_ = {'center': True,
                   'flip': False,
                   'scale_min': 0,
@@ -145,7 +153,9 @@ class ImageParams(MediaParams):
                   'green_mean': 119,
                   'red_mean': 104,
                   'gray_mean': 127,
-                  'color_noise_std': 0}
+                  'color_noise_std': 0,
+                  'decode_cache_mb': 0,
+                  'decode_cache': None}
 
     def __init__(self, **kwargs):
         for key in kwargs:
@@ -154,7 +164,7 @@ class ImageParams(MediaParams):
         for key, value in self._defaults_.items():
             setattr(self, key, value)
         super(ImageParams, self).__init__(mtype=MediaType.image, **kwargs)
-        for key in ['color_noise_std']:
+        for key in ['color_noise_std', 'decode_cache']:
             if getattr(self, key) != self._defaults_[key]:
                 raise ValueError('Argument %s must not be specified' % key)
         self.color_noise_std = (self.contrast_max - 100) / 400.
@@ -176,14 +186,36 @@ class ImageParams(MediaParams):
 
 
 class ImageIngestParams(MediaParams):
+    """
+    Used to specify how images are stored when a dataset is ingested.
+
+    Arguments:
+        resize_at_ingest (bool, optional):
+            Resize images so that their short side lies between
+            short_side_min and short_side_max.  Defaults to False.
+        lossy_encoding (bool, optional):
+            Re-encode resized images as JPEG rather than PNG.  Defaults to
+            True.
+        short_side_min (int, optional):
+            Minimum length of the short side after resizing.
+        short_side_max (int, optional):
+            Maximum length of the short side after resizing.
+        raw_pixels (bool, optional):
+            Store decoded pixels instead of encoded images, so that images do
+            not have to be decoded while training.  This saves a lot of time
+            for small images at the cost of larger archives.  Defaults to
+            False.
+    """
     _fields_ = [('resize_at_ingest', ct.c_bool),
                 ('lossy_encoding', ct.c_bool),
                 ('short_side_min', ct.c_int),
-                ('short_side_max', ct.c_int)]
+                ('short_side_max', ct.c_int),
+                ('raw_pixels', ct.c_bool)]
     _defaults_ = {'resize_at_ingest': False,
                   'lossy_encoding': True,
                   'short_side_min': 0,
-                  'short_side_max': 0}
+                  'short_side_max': 0,
+                  'raw_pixels': False}
 
     def __init__(self, **kwargs):
         for key in kwargs: